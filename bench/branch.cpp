@@ -0,0 +1,100 @@
+// Block dispatch on a tight Jez loop: successor slots against the former
+// lookup through the commands' successor pointers.
+// usage: branch-bench [ITERATIONS]
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+#include "../src/basic_blocks.hpp"
+
+namespace {
+
+size_t allocations = 0;
+
+template <typename Func>
+double measure(Func func) {
+  auto start = std::chrono::steady_clock::now();
+  func();
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+// BasicBlockGraph::exec before terminators returned a slot: the command
+// closing a block led to a stand-in for its successor, and the stand-in was
+// looked up among the locked successor pointers to recover the index
+class PointerDispatch {
+ public:
+  explicit PointerDispatch(const BasicBlockGraph &bbg) : bbg(bbg), entries(bbg.size()), nexts(bbg.size()) {
+    for (auto &entry : entries) entry = std::make_shared<Nop>();
+    for (size_t i = 0; i < bbg.size(); ++i) {
+      for (const int32_t next : bbg[i].get_next_index()) nexts[i].emplace_back(entries[next]);
+    }
+  }
+  void exec() const {
+    Stack stack;
+    int32_t index = 0;
+    while (index >= 0) {
+      int32_t slot = -1;
+      for (const auto &cmd : bbg[index].get_commands()) slot = cmd->exec(stack);
+      const auto &targets = nexts[index];
+      if (slot < 0 || static_cast<size_t>(slot) >= targets.size()) break;
+      const std::shared_ptr<Command> res = targets[slot].lock();
+      std::vector<std::shared_ptr<Command>> locked;
+      for (const auto &target : targets) locked.push_back(target.lock());
+      const auto itr = std::find(std::begin(locked), std::end(locked), res);
+      index = bbg[index].get_next_index()[itr - std::begin(locked)];
+    }
+  }
+ private:
+  const BasicBlockGraph &bbg;
+  std::vector<std::shared_ptr<Command>> entries;
+  std::vector<std::vector<std::weak_ptr<Command>>> nexts;
+};
+
+} // namespace
+
+void *operator new(const size_t size) {
+  ++allocations;
+  if (void *p = std::malloc(size)) return p;
+  throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, size_t) noexcept { std::free(p); }
+
+int main(int argc, char *argv[]) {
+  const int32_t iterations = argc > 1 ? std::stoi(argv[1]) : 20000000;
+  // counts down to zero, one Jez per iteration
+  const pas::PAS program({
+    "PUSH " + std::to_string(iterations),
+    "LABEL loop",
+    "DUP",
+    "JEZ end",
+    "PUSH 1",
+    "SUB",
+    "JMP loop",
+    "LABEL end",
+    "HALT",
+  });
+  const CommandGraph cg(program);
+  const BasicBlockGraph bbg(cg);
+  const PointerDispatch pointers(bbg);
+
+  size_t before = allocations;
+  const double slot_time = measure([&] { bbg.exec(); });
+  const size_t slot_allocations = allocations - before;
+  before = allocations;
+  const double pointer_time = measure([&] { pointers.exec(); });
+  const size_t pointer_allocations = allocations - before;
+
+  std::cout << iterations << " iterations, " << bbg.size() << " blocks" << std::endl;
+  std::cout << "successor slots: " << slot_time << " ms, "
+            << slot_allocations << " allocations" << std::endl;
+  std::cout << "successor pointers: " << pointer_time << " ms, "
+            << pointer_allocations << " allocations" << std::endl;
+  return 0;
+}
@@ -0,0 +1,61 @@
+// RGB to codel classification: scalar lookup against the SIMD kernel.
+// usage: classify-bench [WIDTH] [HEIGHT]
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include "../src/codel.hpp"
+
+namespace {
+
+template <typename Func>
+double measure(Func func) {
+  auto start = std::chrono::steady_clock::now();
+  func();
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  const size_t width = argc > 1 ? std::stoul(argv[1]) : 4000;
+  const size_t height = argc > 2 ? std::stoul(argv[2]) : 4000;
+  // mostly Piet colours with some off-palette channels, like anti-aliased images
+  std::mt19937 rng(0);
+  std::uniform_int_distribution<int> level_dist(0, 2), noise_dist(0, 15), byte_dist(0, 255);
+  const png::byte levels[3] = { 0x00, 0xC0, 0xFF };
+  std::vector<png::byte> rgb(width * height * 3);
+  for (auto &byte : rgb) {
+    byte = noise_dist(rng) ? levels[level_dist(rng)] : byte_dist(rng);
+  }
+
+  std::vector<Codel> reference(width * height), simd(width * height), parallel(width * height);
+  const double scalar_time = measure([&] {
+    for (size_t i = 0; i < height; ++i) {
+      classify_pixels_scalar(&rgb[i * width * 3], width, 1, &reference[i * width]);
+    }
+  });
+  const double simd_time = measure([&] {
+    for (size_t i = 0; i < height; ++i) {
+      classify_pixels(&rgb[i * width * 3], width, 1, &simd[i * width]);
+    }
+  });
+  const double parallel_time = measure([&] {
+#pragma omp parallel for
+    for (size_t i = 0; i < height; ++i) {
+      classify_pixels(&rgb[i * width * 3], width, 1, &parallel[i * width]);
+    }
+  });
+  if (simd != reference || parallel != reference) {
+    std::cerr << "mismatch against the scalar path" << std::endl;
+    return EXIT_FAILURE;
+  }
+  std::cout << width << "x" << height << " pixels" << std::endl;
+  std::cout << "scalar: " << scalar_time << " ms" << std::endl;
+  std::cout << "simd: " << simd_time << " ms" << std::endl;
+  std::cout << "simd, rows in parallel: " << parallel_time << " ms" << std::endl;
+  return 0;
+}
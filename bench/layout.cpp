@@ -0,0 +1,95 @@
+// Colour block graph construction with row-major and tiled grids.
+// usage: layout-bench [SCALE]
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include "../src/color_blocks.hpp"
+
+namespace {
+
+template <typename Func>
+double measure(Func func) {
+  auto start = std::chrono::steady_clock::now();
+  func();
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+png::rgb_pixel random_color(std::mt19937 &rng) {
+  const png::byte levels[3] = { 0x00, 0xC0, 0xFF };
+  const int k = std::uniform_int_distribution<int>(1, 24)(rng);  // neither black nor white
+  return png::rgb_pixel(levels[k % 3], levels[k / 3 % 3], levels[k / 9]);
+}
+
+// random colours with some white and black, in a narrow, very tall image
+Image tall(const size_t scale, std::mt19937 &rng) {
+  Image image(256, 8192 * scale);
+  std::uniform_int_distribution<int> dist(0, 9);
+  for (size_t y = 0; y < image.get_height(); ++y) {
+    for (size_t x = 0; x < image.get_width(); ++x) {
+      const int r = dist(rng);
+      image[y][x] = r < 3 ? png::rgb_pixel(0xFF, 0xFF, 0xFF) : r < 4 ? png::rgb_pixel(0, 0, 0) : random_color(rng);
+    }
+  }
+  return image;
+}
+
+// white columns between columns of small blocks, crossed by black bars
+// that send slides up and down the corridors
+Image corridors(const size_t scale, std::mt19937 &rng) {
+  Image image(1024 * scale, 1024 * scale);
+  for (size_t y = 0; y < image.get_height(); ++y) {
+    for (size_t x = 0; x < image.get_width(); ++x) {
+      if (x % 16 == 0) {
+        image[y][x] = random_color(rng);
+      } else if (y % 64 == 0 && x % 16 > 4) {
+        image[y][x] = png::rgb_pixel(0, 0, 0);
+      } else {
+        image[y][x] = png::rgb_pixel(0xFF, 0xFF, 0xFF);
+      }
+    }
+  }
+  return image;
+}
+
+bool same(const ColorBlockGraph &a, const ColorBlockGraph &b) {
+  if (a.size() != b.size()) return false;
+  for (size_t i = 0; i < a.size(); ++i) {
+    for (uint8_t dp = 0; dp < 4; ++dp) {
+      for (uint8_t cc = 0; cc < 2; ++cc) {
+        if (a[i].get_next_block(dp, cc) != b[i].get_next_block(dp, cc)) return false;
+      }
+    }
+  }
+  return true;
+}
+
+bool run(const std::string &name, const Image &image) {
+  const CodelTable rows(image, 1, GridLayout::rows);
+  const CodelTable tiles(image, 1, GridLayout::tiles);
+  std::unique_ptr<ColorBlockGraph> by_rows, by_tiles;
+  const double rows_time = measure([&] { by_rows = std::make_unique<ColorBlockGraph>(rows); });
+  const double tiles_time = measure([&] { by_tiles = std::make_unique<ColorBlockGraph>(tiles); });
+  if (!same(*by_rows, *by_tiles)) {
+    std::cerr << name << ": layouts disagree" << std::endl;
+    return false;
+  }
+  std::cout << name << " " << image.get_width() << "x" << image.get_height()
+            << ", " << by_rows->size() << " blocks" << std::endl;
+  std::cout << "  rows: " << rows_time << " ms" << std::endl;
+  std::cout << "  tiles: " << tiles_time << " ms" << std::endl;
+  return true;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  const size_t scale = argc > 1 ? std::stoul(argv[1]) : 4;
+  std::mt19937 rng(0);
+  if (!run("tall", tall(scale, rng))) return EXIT_FAILURE;
+  if (!run("corridors", corridors(scale, rng))) return EXIT_FAILURE;
+  return 0;
+}
@@ -0,0 +1,72 @@
+// Roll-heavy microbenchmark: random access into a deep stack through Roll.
+// usage: roll-bench [STACK SIZE] [ROLL COUNT]
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <tuple>
+#include <vector>
+#include "../lib/stack.hpp"
+
+namespace {
+
+// Stack::roll before it rotated in place
+void roll_with_buffer(std::vector<int32_t> &data, const int32_t depth, const int32_t iter) {
+  std::vector<int32_t> buf(depth);
+  for (int i = 0; i < iter; ++i) {
+    buf[i] = data[data.size() - iter + i];
+  }
+  for (int i = 0; i < depth - iter; ++i) {
+    buf[i+iter] = data[data.size() - depth + i];
+  }
+  for (int i = 0; i < depth; ++i) {
+    data[data.size() - depth + i] = buf[i];
+  }
+}
+
+template <typename Func>
+double measure(Func func) {
+  auto start = std::chrono::steady_clock::now();
+  func();
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  const size_t size = argc > 1 ? std::stoul(argv[1]) : 100000;
+  const size_t count = argc > 2 ? std::stoul(argv[2]) : 20000;
+  // Bringing the n-th element to the top is Roll(n, n-1), putting it back is Roll(n, 1)
+  std::mt19937 rng(0);
+  std::uniform_int_distribution<int32_t> depth_dist(2, size);
+  std::vector<std::tuple<int32_t, int32_t>> rolls;
+  for (size_t i = 0; i < count; ++i) {
+    const int32_t depth = depth_dist(rng);
+    rolls.emplace_back(depth, i % 2 ? 1 : depth - 1);
+  }
+
+  std::vector<int32_t> reference(size);
+  Stack stack;
+  for (size_t i = 0; i < size; ++i) {
+    reference[i] = i;
+    stack.push(i);
+  }
+  const double buffered = measure([&] {
+    for (const auto &[depth, iter] : rolls) roll_with_buffer(reference, depth, iter);
+  });
+  const double in_place = measure([&] {
+    for (const auto &[depth, iter] : rolls) stack.roll(depth, iter);
+  });
+  for (size_t i = 0; i < size; ++i) {
+    if (stack.peek(i) != reference[size - 1 - i]) {
+      std::cerr << "mismatch at depth " << i << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+  std::cout << count << " rolls on a stack of " << size << std::endl;
+  std::cout << "buffered: " << buffered << " ms" << std::endl;
+  std::cout << "in place: " << in_place << " ms" << std::endl;
+  return 0;
+}
@@ -0,0 +1,142 @@
+#pragma once
+#include <cctype>
+#include <cerrno>
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "output.hpp"
+
+// Buffered stdin shared by the interpreter and compiled programs.
+// A regular file on stdin is mapped as a whole, anything else is read in
+// large blocks; pending output is flushed only before a read that may block.
+//
+// get_number skips whitespace and parses an optionally signed decimal.
+// Out of range values saturate. If no number follows, 0 is returned and the
+// input is left as it is, so a later get_char still sees it. At end of input
+// get_number returns 0 and get_char returns eof. An invalid UTF-8 lead byte
+// is not consumed and reads as eof.
+
+namespace input {
+
+constexpr int32_t eof = -1;
+
+class Reader {
+ public:
+  static constexpr std::size_t capacity = 1 << 16;
+  Reader() : pos(data), end(data), mapping(nullptr), mapping_size(0), started(false), done(false) {}
+  Reader(const Reader &) = delete;
+  Reader &operator=(const Reader &) = delete;
+  ~Reader() {
+    if (mapping != nullptr) ::munmap(mapping, mapping_size);
+  }
+  int32_t get_number() {
+    for (;; ++pos) {
+      if (pos == end && !fill()) return 0;
+      if (!std::isspace(static_cast<unsigned char>(*pos))) break;
+    }
+    // the whole token has to be in the buffer for from_chars
+    const char *last;
+    do {
+      last = pos + (*pos == '+' || *pos == '-');
+      while (last != end && is_digit(*last)) ++last;
+    } while (last == end && fill());
+    const char *digits = pos + (*pos == '+' || *pos == '-');
+    if (digits == end || !is_digit(*digits)) return 0;
+    const char *first = pos + (*pos == '+');
+    int32_t value = 0;
+    const auto res = std::from_chars(first, last, value);
+    if (res.ec == std::errc::result_out_of_range) {
+      value = *first == '-' ? std::numeric_limits<int32_t>::min() : std::numeric_limits<int32_t>::max();
+    }
+    pos = res.ptr;
+    return value;
+  }
+  int32_t get_char() {
+    if (pos == end && !fill()) return eof;
+    const unsigned char head = *pos;
+    if (head <= 0x7F) {
+      ++pos;
+      return head;
+    }
+    int length;
+    if (0xC2 <= head && head <= 0xDF) {
+      length = 1;
+    } else if (0xE0 <= head && head <= 0xEF) {
+      length = 2;
+    } else if (0xF0 <= head && head <= 0xF7) {
+      length = 3;
+    } else {
+      return eof;
+    }
+    while (end - pos <= length && fill()) {}
+    if (end - pos <= length) {
+      pos = end;
+      return eof;
+    }
+    int32_t res = (static_cast<int32_t>(head) & ~(0xFF << (6 - length))) << (length * 6);
+    for (int i = 1; i <= length; ++i) {
+      res |= (static_cast<unsigned char>(pos[i]) & 0x3F) << ((length - i) * 6);
+    }
+    pos += length + 1;
+    return res;
+  }
+ private:
+  static bool is_digit(const char c) { return '0' <= c && c <= '9'; }
+  bool map() {
+    struct stat st;
+    if (::fstat(STDIN_FILENO, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) return false;
+    const off_t offset = ::lseek(STDIN_FILENO, 0, SEEK_CUR);
+    if (offset < 0 || offset > st.st_size) return false;
+    void *addr = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, STDIN_FILENO, 0);
+    if (addr == MAP_FAILED) return false;
+    ::madvise(addr, st.st_size, MADV_SEQUENTIAL);
+    mapping = addr;
+    mapping_size = st.st_size;
+    pos = static_cast<const char *>(addr) + offset;
+    end = static_cast<const char *>(addr) + st.st_size;
+    return true;
+  }
+  // keeps [pos, end) and appends at least one byte; false at end of input
+  bool fill() {
+    if (!started) {
+      started = true;
+      if (map()) return pos != end;
+    }
+    if (mapping != nullptr || done) return false;
+    const std::size_t rest = end - pos;
+    if (rest == capacity) return false;
+    if (pos != data) std::memmove(data, pos, rest);
+    pos = data;
+    end = data + rest;
+    output::flush();
+    for (;;) {
+      const ssize_t res = ::read(STDIN_FILENO, data + rest, capacity - rest);
+      if (res < 0 && errno == EINTR) continue;
+      if (res <= 0) {
+        done = true;
+        return false;
+      }
+      end += res;
+      return true;
+    }
+  }
+  const char *pos;
+  const char *end;
+  void *mapping;
+  std::size_t mapping_size;
+  bool started;
+  bool done;
+  char data[capacity];
+};
+
+inline Reader reader;
+
+inline int32_t get_number() { return reader.get_number(); }
+inline int32_t get_char() { return reader.get_char(); }
+
+} // namespace input
@@ -0,0 +1,68 @@
+#pragma once
+#include <cerrno>
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <unistd.h>
+
+// Buffered stdout shared by the interpreter and compiled programs.
+// Output is only written when the buffer fills up, before input is read and
+// at exit (the buffer is flushed on static destruction, which std::exit runs).
+
+namespace output {
+
+class Buffer {
+ public:
+  static constexpr std::size_t capacity = 1 << 16;
+  Buffer() : size(0) {}
+  Buffer(const Buffer &) = delete;
+  Buffer &operator=(const Buffer &) = delete;
+  ~Buffer() { flush(); }
+  // UTF-8; values outside the Unicode range print U+FFFD
+  void put_char(const int32_t value) {
+    if (size + 4 > capacity) flush();
+    const uint32_t code = (value < 0 || value > 0x10FFFF) ? 0xFFFD : value;
+    if (code < 0x80) {
+      data[size++] = code;
+    } else if (code < 0x800) {
+      data[size++] = 0xC0 | (code >> 6);
+      data[size++] = 0x80 | (code & 0x3F);
+    } else if (code < 0x10000) {
+      data[size++] = 0xE0 | (code >> 12);
+      data[size++] = 0x80 | ((code >> 6) & 0x3F);
+      data[size++] = 0x80 | (code & 0x3F);
+    } else {
+      data[size++] = 0xF0 | (code >> 18);
+      data[size++] = 0x80 | ((code >> 12) & 0x3F);
+      data[size++] = 0x80 | ((code >> 6) & 0x3F);
+      data[size++] = 0x80 | (code & 0x3F);
+    }
+  }
+  void put_number(const int32_t value) {
+    if (size + 11 > capacity) flush();
+    size = std::to_chars(data + size, data + capacity, value).ptr - data;
+  }
+  void flush() {
+    std::size_t written = 0;
+    while (written < size) {
+      const ssize_t res = ::write(STDOUT_FILENO, data + written, size - written);
+      if (res < 0) {
+        if (errno == EINTR) continue;
+        break;
+      }
+      written += res;
+    }
+    size = 0;
+  }
+ private:
+  std::size_t size;
+  char data[capacity];
+};
+
+inline Buffer buffer;
+
+inline void put_char(const int32_t value) { buffer.put_char(value); }
+inline void put_number(const int32_t value) { buffer.put_number(value); }
+inline void flush() { buffer.flush(); }
+
+} // namespace output
@@ -1,55 +1,37 @@
 #include "stack.hpp"
-#include <iostream>
-#include <locale>
-#include <codecvt>
+#include <algorithm>
+#include <stdexcept>
+#include "input.hpp"
+#include "output.hpp"
 
 int32_t get_number() {
-  int32_t value;
-  std::cin >> value;
-  return value;
+  return input::get_number();
 }
 
-constexpr int32_t eof = std::char_traits<char32_t>::eof();
-
 int32_t get_char() {
-  char head;
-  if(!std::cin.get(head)) return eof;
-  unsigned char uhead = head;
-  if (uhead <= 0x7F) {
-    return head;
-  } else {
-    int length;
-    int32_t res = 0;
-    if (0xC2 <= uhead && uhead <= 0xDF) {
-      length = 1;
-    } else if (0xE0 <= uhead && uhead <= 0xEF) {
-      length = 2;
-    } else if (0xF0 <= uhead && uhead <= 0xF7) {
-      length = 3;
-    } else {
-      std::cin.unget();
-      return eof;
-    }
-    res |= (static_cast<int32_t>(uhead) & ~(0xFF << (6 - length))) << (length * 6);
-    for(--length; length >= 0; --length) {
-      char tail;
-      if (!std::cin.get(tail)) return eof;
-      res |= (static_cast<int32_t>(tail) & 0x3F) << (length * 6);
-    }
-    return res;
-  } 
+  return input::get_char();
 }
 
+// Rotates in place: the shorter side of the window goes through a small
+// buffer on the machine stack and the rest is moved with a single memmove.
 void Stack::roll(const int32_t depth, const int32_t iter) {
-  std::vector<int32_t> buf(depth);
-  for (int i = 0; i < iter; ++i) {
-    buf[i] = data[data.size() - iter + i];
-  }
-  for (int i = 0; i < depth - iter; ++i) {
-    buf[i+iter] = data[data.size() - depth + i];
-  }
-  for (int i = 0; i < depth; ++i) {
-    data[data.size() - depth + i] = buf[i];
+  constexpr int32_t buffer_size = 64;
+  int32_t * const last = data.data() + data.size();
+  int32_t * const first = last - depth;
+  const int32_t rest = depth - iter;
+  if (iter == 0) return;
+  if (iter <= buffer_size) {
+    int32_t buf[buffer_size];
+    std::copy(last - iter, last, buf);
+    std::copy_backward(first, last - iter, last);
+    std::copy(buf, buf + iter, first);
+  } else if (rest <= buffer_size) {
+    int32_t buf[buffer_size];
+    std::copy(first, first + rest, buf);
+    std::copy(first + rest, last, first);
+    std::copy(buf, buf + rest, last - rest);
+  } else {
+    std::rotate(first, last - iter, last);
   }
 }
 
@@ -74,6 +56,19 @@ void Stack::roll() {
   } 
 }
 
+void Stack::roll_unchecked() {
+  const int32_t iter = top(); data.pop_back();
+  const int32_t depth = top(); data.pop_back();
+  if (depth >= 0 && size() >= (size_t)depth) {
+    if (depth > 0) {
+      roll(depth, ::mod(iter, depth));
+    }
+  } else {
+    push(depth);
+    push(iter);
+  }
+}
+
 int32_t Stack::switch_() {
   if (!empty()) {
     int32_t value;
@@ -111,11 +106,12 @@ int32_t Stack::eq_zero() {
   }
 }
 
-void putchar_32(const int32_t val) {
-  char32_t ch = static_cast<char32_t>(val);
-  std::u32string u32s(1, ch);
-  std::wstring_convert<std::codecvt_utf8<char32_t>, char32_t> u32tou8;
-  std::cout << u32tou8.to_bytes(u32s);
+void put_number(const int32_t val) {
+  output::put_number(val);
+}
+
+void put_char(const int32_t val) {
+  output::put_char(val);
 }
 
 //std::shared_ptr<Command> InNumber::exec(Stack & stack) const {
@@ -140,18 +136,28 @@ void putchar_32(const int32_t val) {
 
 void Stack::out_number() {
   if (!empty()) {
-    std::cout << top();
+    output::put_number(top());
     pop();
   }
 }
 
 void Stack::out_char() {
   if (!empty()) {
-    putchar_32(top());
+    output::put_char(top());
     pop();
   }
 }
 
+void Stack::out_number_unchecked() {
+  output::put_number(top());
+  data.pop_back();
+}
+
+void Stack::out_char_unchecked() {
+  output::put_char(top());
+  data.pop_back();
+}
+
 template <typename Func>
 void Stack::bin_op(Func func) noexcept {
   if (size() >= 2) {
@@ -180,11 +186,17 @@ void Stack::mul() {
 }
 
 void Stack::div() {
-  bin_op(std::divides<int32_t>());
+  bin_op([](int32_t lhs, int32_t rhs) {
+    if (rhs == 0) throw std::domain_error("divide by zero");
+    return lhs / rhs;
+  });
 }
 
 void Stack::mod() {
-  bin_op(std::modulus<int32_t>());
+  bin_op([](int32_t lhs, int32_t rhs) {
+    if (rhs == 0) throw std::domain_error("divide by zero");
+    return lhs % rhs;
+  });
 }
 
 void Stack::greater() {
@@ -203,9 +215,67 @@ void Stack::not_() {
   }
 }
 
+void Stack::swap() {
+  if (size() >= 2) {
+    int32_t arg2 = top(); pop();
+    int32_t arg1 = top(); pop();
+    push(arg2);
+    push(arg1);
+  }
+}
+
 void Stack::duplicate() {
   if (!empty()) {
     int32_t value = top();
     push(value);
   }
 }
+
+void Stack::add_imm(const int32_t value) {
+  if (!empty()) {
+    data.back() += value;
+  } else {
+    push(value);
+  }
+}
+
+void Stack::sub_imm(const int32_t value) {
+  if (!empty()) {
+    data.back() -= value;
+  } else {
+    push(value);
+  }
+}
+
+void Stack::mul_imm(const int32_t value) {
+  if (!empty()) {
+    data.back() *= value;
+  } else {
+    push(value);
+  }
+}
+
+void Stack::not_not() {
+  if (!empty()) {
+    data.back() = data.back() ? 1 : 0;
+  }
+}
+
+void Stack::roll_const(const int32_t depth, const int32_t iter) {
+  if (depth >= 0 && size() >= (size_t)depth) {
+    if (depth > 0) {
+      roll(depth, ::mod(iter, depth));
+    }
+  } else {
+    push(depth);
+    push(iter);
+  }
+}
+
+int32_t Stack::dup_eq_zero() {
+  if (!empty() && top() == 0) {
+    return 1;
+  } else {
+    return 0;
+  }
+}
@@ -1,14 +1,20 @@
 #pragma once
 #include <cstdint>
+#include <utility>
 #include <vector>
 
 int32_t get_number();
 int32_t get_char();
+void put_number(const int32_t);
+void put_char(const int32_t);
+int32_t mod(int32_t x, int32_t d);
 
 class Stack {
  public:
   Stack() : data() {}
   int32_t top() const { return data.back(); }
+  int32_t peek(const std::size_t depth) const { return data[data.size() - 1 - depth]; }
+  void drop(const std::size_t count) { data.resize(data.size() - count); }
   bool empty() const noexcept { return data.empty(); }
   std::size_t size() const noexcept { return data.size(); }
   void pop() {
@@ -17,6 +23,7 @@ class Stack {
     }
   }
   void push(const int32_t x) { data.push_back(x); }
+  void reserve(const std::size_t capacity) { data.reserve(capacity); }
   void push_array(const std::vector<int32_t> &ary) {
     using std::begin;
     using std::end;
@@ -32,11 +39,48 @@ class Stack {
   void greater();
   void duplicate();
   void not_();
+  void swap();
   void out_number();
   void out_char();
   int32_t switch_();
   int32_t pointer();
   int32_t eq_zero();
+  void add_imm(const int32_t value);
+  void sub_imm(const int32_t value);
+  void mul_imm(const int32_t value);
+  void not_not();
+  void roll_const(const int32_t depth, const int32_t iter);
+  int32_t dup_eq_zero();
+  // Variants for code where the stack is known to hold enough elements
+  void add_unchecked() { const int32_t rhs = top(); data.pop_back(); data.back() += rhs; }
+  void sub_unchecked() { const int32_t rhs = top(); data.pop_back(); data.back() -= rhs; }
+  void mul_unchecked() { const int32_t rhs = top(); data.pop_back(); data.back() *= rhs; }
+  void div_unchecked() {
+    const int32_t rhs = top();
+    if (rhs != 0) { data.pop_back(); data.back() /= rhs; }
+  }
+  void mod_unchecked() {
+    const int32_t rhs = top();
+    if (rhs != 0) { data.pop_back(); data.back() %= rhs; }
+  }
+  void greater_unchecked() { const int32_t rhs = top(); data.pop_back(); data.back() = data.back() > rhs ? 1 : 0; }
+  void duplicate_unchecked() { push(top()); }
+  void not_unchecked() { data.back() = data.back() ? 0 : 1; }
+  void swap_unchecked() { std::swap(data.back(), data[data.size() - 2]); }
+  void roll_unchecked();
+  void out_number_unchecked();
+  void out_char_unchecked();
+  int32_t switch_unchecked() { const int32_t value = top(); data.pop_back(); return ::mod(value, 2); }
+  int32_t pointer_unchecked() { const int32_t value = top(); data.pop_back(); return ::mod(value, 4); }
+  int32_t eq_zero_unchecked() { const int32_t value = top(); data.pop_back(); return value == 0 ? 1 : 0; }
+  void add_imm_unchecked(const int32_t value) { data.back() += value; }
+  void sub_imm_unchecked(const int32_t value) { data.back() -= value; }
+  void mul_imm_unchecked(const int32_t value) { data.back() *= value; }
+  void not_not_unchecked() { data.back() = data.back() ? 1 : 0; }
+  void roll_const_unchecked(const int32_t depth, const int32_t iter) {
+    if (depth > 0) roll(depth, ::mod(iter, depth));
+  }
+  int32_t dup_eq_zero_unchecked() const { return top() == 0 ? 1 : 0; }
 template <typename Func>
   void bin_op(Func func) noexcept;
  private:
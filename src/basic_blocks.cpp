@@ -1,28 +1,450 @@
 #include "basic_blocks.hpp"
 #include <algorithm>
+#include <limits>
 #include <memory>
 #include <map>
 #include <queue>
 #include <set>
 
+void BasicBlock::append(const BasicBlock &next) {
+  commands.insert(std::end(commands), std::begin(next.commands), std::end(next.commands));
+  next_index = next.next_index;
+  unchecked.clear();
+}
+
+void BasicBlock::renumber(const std::vector<int32_t> &index) {
+  for (auto &next : next_index) next = index[next];
+}
+
+bool BasicBlock::is_trampoline() const {
+  return next_index.size() == 1 && std::all_of(std::begin(commands), std::end(commands),
+      [](const auto &cmd) { return cmd->command_type() == ConcreteCommandType::Nop; });
+}
+
+// Only the slot returned by the last command matters; a single path
+// command without a successor ends the program like Halt.
 int32_t BasicBlock::exec(Stack &stack) const {
-  using std::begin;
-  using std::end;
+  int32_t slot = -1;
   for (size_t i = 0; i < commands.size(); ++i) {
-    auto res = commands[i]->exec(stack);
-    if (i == commands.size() - 1) {
-      if (res == nullptr) return -1;
-      auto nexts = commands[i]->get_nexts();
-      auto itr = std::find(begin(nexts), end(nexts), res);
-      return next_index[itr - begin(nexts)];
+    slot = i < unchecked.size() && unchecked[i] ? commands[i]->exec_unchecked(stack) : commands[i]->exec(stack);
+  }
+  return slot >= 0 && static_cast<size_t>(slot) < next_index.size() ? next_index[slot] : -1;
+}
+
+namespace {
+
+size_t constant_count(const Command &cmd) {
+  switch (cmd.command_type()) {
+    case ConcreteCommandType::Push:
+      return 1;
+    case ConcreteCommandType::PushArray:
+      return dynamic_cast<const PushArray &>(cmd).get_data().size();
+    default:
+      return 0;
+  }
+}
+
+// Removes the last constant pushed by the last command of cmds
+int32_t take_constant(std::vector<std::shared_ptr<Command>> &cmds) {
+  if (cmds.back()->command_type() == ConcreteCommandType::Push) {
+    int32_t value = dynamic_cast<const Push &>(*cmds.back()).get_value();
+    cmds.pop_back();
+    return value;
+  }
+  auto data = dynamic_cast<const PushArray &>(*cmds.back()).get_data();
+  int32_t value = data.back();
+  data.pop_back();
+  if (data.size() > 1) {
+    cmds.back() = std::make_shared<PushArray>(data);
+  } else {
+    cmds.back() = std::make_shared<Push>(data.front());
+  }
+  return value;
+}
+
+constexpr int32_t unbounded = std::numeric_limits<int32_t>::max();
+// raises of a block's maximum entry depth before it is taken as unbounded
+constexpr int32_t max_raises = 8;
+// commands a block may copy from the joins it falls through to
+constexpr size_t max_copied = 16;
+
+int32_t grow(const int32_t depth, const int32_t count) {
+  return depth >= unbounded - count ? unbounded : depth + count;
+}
+
+int32_t shrink(const int32_t depth, const int32_t count) {
+  return depth == unbounded ? unbounded : std::max(depth - count, 0);
+}
+
+// Elements cmd needs to skip its underflow check, -1 if it has none to skip
+int32_t required_depth(const Command &cmd) {
+  switch (cmd.command_type()) {
+    case ConcreteCommandType::Pop:
+      return dynamic_cast<const Pop &>(cmd).get_count();
+    case ConcreteCommandType::Duplicate:
+    case ConcreteCommandType::OutNumber:
+    case ConcreteCommandType::OutChar:
+    case ConcreteCommandType::Not:
+    case ConcreteCommandType::NotNot:
+    case ConcreteCommandType::AddImm:
+    case ConcreteCommandType::SubImm:
+    case ConcreteCommandType::MulImm:
+    case ConcreteCommandType::Switch:
+    case ConcreteCommandType::Pointer:
+    case ConcreteCommandType::Jez:
+    case ConcreteCommandType::DupBranchZero:
+      return 1;
+    case ConcreteCommandType::Add:
+    case ConcreteCommandType::Subtract:
+    case ConcreteCommandType::Multiply:
+    case ConcreteCommandType::Divide:
+    case ConcreteCommandType::Modulo:
+    case ConcreteCommandType::Greater:
+    case ConcreteCommandType::Swap:
+    case ConcreteCommandType::Roll:
+      return 2;
+    case ConcreteCommandType::RollConst:
+      {
+        const int32_t depth = dynamic_cast<const RollConst &>(cmd).get_depth();
+        return depth >= 0 ? depth : -1;
+      }
+    default:
+      return -1;
+  }
+}
+
+// Bounds of the stack depth after cmd, given the bounds before it
+void step(const Command &cmd, DepthRange &range) {
+  switch (cmd.command_type()) {
+    case ConcreteCommandType::Push:
+    case ConcreteCommandType::InNumber:
+    case ConcreteCommandType::InChar:
+      range = DepthRange { grow(range.min, 1), grow(range.max, 1) };
+      break;
+    case ConcreteCommandType::PushArray:
+      {
+        const int32_t count = dynamic_cast<const PushArray &>(cmd).get_data().size();
+        range = DepthRange { grow(range.min, count), grow(range.max, count) };
+      }
+      break;
+    case ConcreteCommandType::Pop:
+      {
+        const int32_t count = dynamic_cast<const Pop &>(cmd).get_count();
+        range = DepthRange { shrink(range.min, count), shrink(range.max, count) };
+      }
+      break;
+    case ConcreteCommandType::Duplicate:
+      range = DepthRange { range.min > 0 ? grow(range.min, 1) : 0, range.max > 0 ? grow(range.max, 1) : 0 };
+      break;
+    case ConcreteCommandType::OutNumber:
+    case ConcreteCommandType::OutChar:
+    case ConcreteCommandType::Switch:
+    case ConcreteCommandType::Pointer:
+    case ConcreteCommandType::Jez:
+      range = DepthRange { shrink(range.min, 1), shrink(range.max, 1) };
+      break;
+    case ConcreteCommandType::Add:
+    case ConcreteCommandType::Subtract:
+    case ConcreteCommandType::Multiply:
+    case ConcreteCommandType::Greater:
+      range = DepthRange { range.min >= 2 ? range.min - 1 : range.min, range.max >= 2 ? shrink(range.max, 1) : range.max };
+      break;
+    case ConcreteCommandType::Divide:
+    case ConcreteCommandType::Modulo:
+      // ignored on a zero divisor
+      range.min = range.min >= 2 ? range.min - 1 : range.min;
+      break;
+    case ConcreteCommandType::Roll:
+      range.min = shrink(range.min, 2);
+      break;
+    case ConcreteCommandType::RollConst:
+      {
+        const int32_t depth = dynamic_cast<const RollConst &>(cmd).get_depth();
+        if (depth < 0) {
+          range = DepthRange { grow(range.min, 2), grow(range.max, 2) };
+        } else if (range.min < depth) {
+          range.max = grow(range.max, 2);
+        }
+      }
+      break;
+    case ConcreteCommandType::AddImm:
+    case ConcreteCommandType::SubImm:
+    case ConcreteCommandType::MulImm:
+      range = DepthRange { std::max(range.min, 1), std::max(range.max, 1) };
+      break;
+    default:
+      break;
+  }
+}
+
+} // namespace
+
+std::set<Fusion> parse_fusions(const std::string &str) {
+  static const std::map<std::string, Fusion> names = {
+    {"add_imm",         Fusion::AddImm},
+    {"sub_imm",         Fusion::SubImm},
+    {"mul_imm",         Fusion::MulImm},
+    {"not_not",         Fusion::NotNot},
+    {"roll_const",      Fusion::RollConst},
+    {"dup_branch_zero", Fusion::DupBranchZero}
+  };
+  std::set<Fusion> res;
+  if (str == "none") return res;
+  if (str == "all") {
+    for (const auto &name : names) res.insert(name.second);
+    return res;
+  }
+  std::string::size_type old = 0;
+  while (old <= str.size()) {
+    auto pos = std::min(str.find(',', old), str.size());
+    auto itr = names.find(str.substr(old, pos - old));
+    if (itr == std::end(names)) {
+      throw std::invalid_argument("Unknown fusion pattern: " + str.substr(old, pos - old));
+    }
+    res.insert(itr->second);
+    old = pos + 1;
+  }
+  return res;
+}
+
+void BasicBlock::fuse(const std::set<Fusion> &patterns) {
+  unchecked.clear();
+  auto enabled = [&](Fusion fusion) { return patterns.count(fusion) > 0; };
+  std::vector<std::shared_ptr<Command>> fused;
+  for (const auto &cmd : commands) {
+    const ConcreteCommandType type = cmd->command_type();
+    const size_t constants = fused.empty() ? 0 : constant_count(*fused.back());
+    const ConcreteCommandType prev_type =
+      fused.empty() ? ConcreteCommandType::Nop : fused.back()->command_type();
+    std::shared_ptr<Command> res;
+    if (constants >= 1 && type == ConcreteCommandType::Add && enabled(Fusion::AddImm)) {
+      res = std::make_shared<AddImm>(take_constant(fused));
+    } else if (constants >= 1 && type == ConcreteCommandType::Subtract && enabled(Fusion::SubImm)) {
+      res = std::make_shared<SubImm>(take_constant(fused));
+    } else if (constants >= 1 && type == ConcreteCommandType::Multiply && enabled(Fusion::MulImm)) {
+      res = std::make_shared<MulImm>(take_constant(fused));
+    } else if (constants >= 2 && type == ConcreteCommandType::Roll && enabled(Fusion::RollConst)) {
+      int32_t iter = take_constant(fused);
+      int32_t depth = take_constant(fused);
+      res = std::make_shared<RollConst>(depth, iter);
+    } else if (prev_type == ConcreteCommandType::Not && type == ConcreteCommandType::Not
+        && enabled(Fusion::NotNot)) {
+      fused.pop_back();
+      res = std::make_shared<NotNot>();
+    } else if (prev_type == ConcreteCommandType::Duplicate && type == ConcreteCommandType::Jez
+        && enabled(Fusion::DupBranchZero)) {
+      fused.pop_back();
+      res = std::make_shared<DupBranchZero>();
     }
+    if (!res) {
+      fused.push_back(cmd);
+      continue;
+    }
+    fused.push_back(res);
+  }
+  commands = std::move(fused);
+}
+
+void BasicBlock::fold() {
+  unchecked.clear();
+  std::vector<std::shared_ptr<Command>> folded;
+  // constants known to be on top of the stack, not yet pushed by a command
+  std::vector<int32_t> constants;
+  auto flush = [&] {
+    if (constants.size() > 1) {
+      folded.push_back(std::make_shared<PushArray>(constants));
+    } else if (constants.size() == 1) {
+      folded.push_back(std::make_shared<Push>(constants.front()));
+    }
+    constants.clear();
+  };
+  auto emit = [&](std::shared_ptr<Command> cmd) {
+    flush();
+    while (cmd && !folded.empty()) {
+      const ConcreteCommandType prev = folded.back()->command_type();
+      const ConcreteCommandType type = cmd->command_type();
+      if (prev == ConcreteCommandType::Duplicate && type == ConcreteCommandType::Pop) {
+        folded.pop_back();
+        const int32_t count = dynamic_cast<const Pop &>(*cmd).get_count() - 1;
+        cmd = count > 0 ? std::make_shared<Pop>(count) : nullptr;
+      } else if (prev == ConcreteCommandType::Pop && type == ConcreteCommandType::Pop) {
+        const int32_t count = dynamic_cast<const Pop &>(*folded.back()).get_count()
+          + dynamic_cast<const Pop &>(*cmd).get_count();
+        folded.pop_back();
+        cmd = std::make_shared<Pop>(count);
+      } else if (prev == ConcreteCommandType::Swap && type == ConcreteCommandType::Swap) {
+        folded.pop_back();
+        cmd = nullptr;
+      } else if (prev == ConcreteCommandType::Duplicate && type == ConcreteCommandType::Swap) {
+        cmd = nullptr;
+      } else {
+        break;
+      }
+    }
+    if (cmd) folded.push_back(cmd);
+  };
+  auto pop = [&] {
+    int32_t value = constants.back();
+    constants.pop_back();
+    return value;
+  };
+  // Piet ignores a command that would underflow, so a command is only folded
+  // when all of its operands are known
+  for (const auto &cmd : commands) {
+    const size_t known = constants.size();
+    const ConcreteCommandType type = cmd->command_type();
+    switch (type) {
+      case ConcreteCommandType::Nop:
+        break;
+      case ConcreteCommandType::Push:
+        constants.push_back(dynamic_cast<const Push &>(*cmd).get_value());
+        break;
+      case ConcreteCommandType::PushArray:
+        {
+          const auto &data = dynamic_cast<const PushArray &>(*cmd).get_data();
+          constants.insert(std::end(constants), std::begin(data), std::end(data));
+        }
+        break;
+      case ConcreteCommandType::Add:
+      case ConcreteCommandType::Subtract:
+      case ConcreteCommandType::Multiply:
+      case ConcreteCommandType::Divide:
+      case ConcreteCommandType::Modulo:
+      case ConcreteCommandType::Greater:
+        {
+          const bool division = type == ConcreteCommandType::Divide || type == ConcreteCommandType::Modulo;
+          // a zero divisor makes the command a no-op whatever lies below it
+          if (division && known >= 1 && constants.back() == 0) break;
+          if (known < 2) {
+            emit(cmd);
+            break;
+          }
+          const int64_t rhs = pop();
+          const int64_t lhs = pop();
+          int64_t res;
+          switch (type) {
+            case ConcreteCommandType::Add: res = lhs + rhs; break;
+            case ConcreteCommandType::Subtract: res = lhs - rhs; break;
+            case ConcreteCommandType::Multiply: res = lhs * rhs; break;
+            case ConcreteCommandType::Divide: res = lhs / rhs; break;
+            case ConcreteCommandType::Modulo: res = lhs % rhs; break;
+            default: res = lhs > rhs ? 1 : 0;
+          }
+          constants.push_back(static_cast<int32_t>(static_cast<uint32_t>(res)));
+        }
+        break;
+      case ConcreteCommandType::AddImm:
+      case ConcreteCommandType::SubImm:
+      case ConcreteCommandType::MulImm:
+        if (known < 1) {
+          emit(cmd);
+          break;
+        }
+        {
+          const int64_t lhs = pop();
+          int64_t res;
+          switch (type) {
+            case ConcreteCommandType::AddImm: res = lhs + dynamic_cast<const AddImm &>(*cmd).get_value(); break;
+            case ConcreteCommandType::SubImm: res = lhs - dynamic_cast<const SubImm &>(*cmd).get_value(); break;
+            default: res = lhs * dynamic_cast<const MulImm &>(*cmd).get_value();
+          }
+          constants.push_back(static_cast<int32_t>(static_cast<uint32_t>(res)));
+        }
+        break;
+      case ConcreteCommandType::Not:
+      case ConcreteCommandType::NotNot:
+        if (known < 1) {
+          emit(cmd);
+        } else {
+          const bool value = pop() != 0;
+          constants.push_back(value == (type == ConcreteCommandType::NotNot) ? 1 : 0);
+        }
+        break;
+      case ConcreteCommandType::Duplicate:
+        if (known < 1) {
+          emit(cmd);
+        } else {
+          constants.push_back(constants.back());
+        }
+        break;
+      case ConcreteCommandType::Swap:
+        if (known < 2) {
+          emit(cmd);
+        } else {
+          std::swap(constants[known - 1], constants[known - 2]);
+        }
+        break;
+      case ConcreteCommandType::Pop:
+        {
+          const int32_t count = dynamic_cast<const Pop &>(*cmd).get_count();
+          const int32_t taken = std::min<int32_t>(count, known);
+          constants.resize(known - taken);
+          if (taken == 0) {
+            emit(cmd);
+          } else if (count > taken) {
+            emit(std::make_shared<Pop>(count - taken));
+          }
+        }
+        break;
+      case ConcreteCommandType::Roll:
+      case ConcreteCommandType::RollConst:
+        {
+          int32_t depth, iter;
+          size_t operands = 0;
+          if (type == ConcreteCommandType::RollConst) {
+            const auto &roll = dynamic_cast<const RollConst &>(*cmd);
+            depth = roll.get_depth();
+            iter = roll.get_iter();
+          } else if (known >= 2) {
+            depth = constants[known - 2];
+            iter = constants[known - 1];
+            operands = 2;
+          } else {
+            emit(cmd);
+            break;
+          }
+          if (depth < 0) {
+            // the operands are put back
+            if (operands == 0) {
+              constants.push_back(depth);
+              constants.push_back(iter);
+            }
+          } else if (static_cast<size_t>(depth) <= known - operands) {
+            constants.resize(known - operands);
+            auto end = std::end(constants);
+            std::rotate(end - depth, end - (depth ? mod(iter, depth) : 0), end);
+          } else {
+            emit(cmd);
+          }
+        }
+        break;
+      default:
+        emit(cmd);
+    }
+  }
+  flush();
+  // the block still has to lead to its successor
+  if (folded.empty()) folded.push_back(std::make_shared<Nop>());
+  commands = std::move(folded);
+}
+
+void BasicBlock::set_entry_depth(const int32_t depth) {
+  unchecked.assign(commands.size(), false);
+  DepthRange range { depth, unbounded };
+  for (size_t i = 0; i < commands.size(); ++i) {
+    const int32_t required = required_depth(*commands[i]);
+    unchecked[i] = required >= 0 && range.min >= required;
+    step(*commands[i], range);
   }
-  return -1;
 }
 
 std::ostream& operator<<(std::ostream &os, const BasicBlock &bb) {
   for (size_t i = 0; i < bb.commands.size(); ++i) {
-    os << bb.commands[i]->to_cpp_string();
+    if (i < bb.unchecked.size() && bb.unchecked[i]) {
+      os << bb.commands[i]->to_unchecked_cpp_string();
+    } else {
+      os << bb.commands[i]->to_cpp_string();
+    }
     if (i == bb.commands.size() - 1) {
       size_t length = bb.next_index.size();
       for (size_t j = 0; j < length; ++j) {
@@ -43,111 +465,310 @@ std::ostream& operator<<(std::ostream &os, const BasicBlock &bb) {
   return os;
 }
 
+// A block starts at node 0, at every successor of a branch and at every
+// node with more than one predecessor, and runs until the next such node, so
+// each node reachable from node 0 is walked once.
 BasicBlockGraph::BasicBlockGraph(const CommandGraph &cg) {
-  using std::end;
-  std::map<std::shared_ptr<Command>, int32_t> ptr_to_index;
-  ptr_to_index[cg.root()] = 0;
-  std::queue<std::shared_ptr<Command>> q;
-  q.push(cg.root());
+  const size_t size = cg.size();
+  std::vector<int32_t> preds(size, 0), order(1, 0);
+  std::vector<bool> leader(size, false), reached(size, false);
+  preds[0] = 1;
+  leader[0] = reached[0] = true;
+  for (size_t i = 0; i < order.size(); ++i) {
+    const size_t count = cg.next_count(order[i]);
+    const int32_t *nexts = cg.nexts(order[i]);
+    for (size_t j = 0; j < count && nexts[j] >= 0; ++j) {
+      ++preds[nexts[j]];
+      if (count != 1) leader[nexts[j]] = true;
+      if (!reached[nexts[j]]) {
+        reached[nexts[j]] = true;
+        order.push_back(nexts[j]);
+      }
+    }
+  }
+  // every loop has a node entered from outside it, or node 0
+  for (const int32_t node : order) {
+    if (preds[node] != 1) leader[node] = true;
+  }
+  std::vector<int32_t> block_of(size, -1);
+  std::vector<int32_t> heads;
+  auto block_index = [&](const int32_t node) {
+    if (block_of[node] < 0) {
+      block_of[node] = heads.size();
+      heads.push_back(node);
+    }
+    return block_of[node];
+  };
+  block_index(0);
   std::vector<int32_t> push_stack;
   int32_t pop_count = 0;
-  while (!q.empty()) {
-    auto ptr = q.front();
-    std::shared_ptr<Command> old_ptr;
-    q.pop();
+  for (size_t head = 0; head < heads.size(); ++head) {
+    int32_t node = heads[head];
+    int32_t last = -1;
     basic_blocks.emplace_back();
-    std::set<std::shared_ptr<Command>> s;
-    while (true) {
-      if (s.count(ptr)) {
-        auto itr = ptr_to_index.find(ptr);
-        std::vector<int32_t> next_index;
-        if (itr != end(ptr_to_index)) {
-          next_index.push_back(itr->second);
-        } else {
-          const int32_t index = ptr_to_index.size();
-          next_index.push_back(index);
-          ptr_to_index[ptr] = index;
-          q.push(ptr);
-        }
-        if (push_stack.size() > 1) {
-          basic_blocks.back().push(std::make_shared<PushArray>(push_stack));
-        } else if (push_stack.size() == 1) {
-          basic_blocks.back().push(old_ptr);
-        }
-        if (pop_count > 1) {
-          basic_blocks.back().push(std::make_shared<Pop>(pop_count));
-        } else if (pop_count == 1) {
-          basic_blocks.back().push(old_ptr);
-        }
-        push_stack.clear();
-        pop_count = 0;
-        break;
+    auto &bb = basic_blocks.back();
+    // pending pushes and pops are merged, and a single one is kept as it is
+    auto flush_push = [&] {
+      if (push_stack.size() > 1) {
+        bb.push(std::make_shared<PushArray>(push_stack));
+      } else if (push_stack.size() == 1) {
+        bb.push(cg.make_command(last));
+      }
+      push_stack.clear();
+    };
+    auto flush_pop = [&] {
+      if (pop_count > 1) {
+        bb.push(std::make_shared<Pop>(pop_count));
+      } else if (pop_count == 1) {
+        bb.push(cg.make_command(last));
       }
-      s.insert(ptr);
-      ConcreteCommandType type = ptr->command_type();
-      bool lazy = false;
+      pop_count = 0;
+    };
+    while (true) {
+      const ConcreteCommandType type = cg.op(node);
       if (type == ConcreteCommandType::Push) {
-        push_stack.push_back(dynamic_cast<Push*>(ptr.get())->get_value());
-        lazy = true;
+        push_stack.push_back(cg.immediate(node));
       } else {
-        if (push_stack.size() > 1) {
-          basic_blocks.back().push(std::make_shared<PushArray>(push_stack));
-        } else if (push_stack.size() == 1) {
-          basic_blocks.back().push(old_ptr);
-        }
-        push_stack.clear();
+        flush_push();
       }
       if (type == ConcreteCommandType::Pop) {
         ++pop_count;
-        lazy = true;
       } else {
-        if (pop_count > 1) {
-          basic_blocks.back().push(std::make_shared<Pop>(pop_count));
-        } else if (pop_count == 1) {
-          basic_blocks.back().push(old_ptr);
-        }
-        pop_count = 0;
-      }
-      if (!lazy) {
-        basic_blocks.back().push(ptr);
-      }
-      auto nexts = ptr->get_nexts();
-      if (nexts.size() != 1) {
-        std::vector<int32_t> next_index;
-        for (auto next : nexts) {
-          auto itr = ptr_to_index.find(next);
-          if (itr != end(ptr_to_index)) {
-            next_index.push_back(itr->second);
-          } else {
-            const int32_t index = ptr_to_index.size();
-            next_index.push_back(index);
-            ptr_to_index[next] = index;
-            q.push(next);
-          }
+        flush_pop();
+      }
+      if (type != ConcreteCommandType::Push && type != ConcreteCommandType::Pop) {
+        bb.push(cg.make_command(node));
+      }
+      last = node;
+      const size_t count = cg.next_count(node);
+      const int32_t *nexts = cg.nexts(node);
+      if (count == 1 && nexts[0] >= 0 && !leader[nexts[0]]) {
+        node = nexts[0];
+        continue;
+      }
+      flush_push();
+      flush_pop();
+      Successors next_index;
+      for (size_t i = 0; i < count && nexts[i] >= 0; ++i) {
+        next_index.push_back(block_index(nexts[i]));
+      }
+      bb.set_nexts(next_index);
+      break;
+    }
+  }
+  merge();
+}
+
+// Jumps to blocks holding nothing but Nops go straight to where those lead,
+// and a block whose only successor has no other predecessor takes that
+// successor's commands. A block that jumps to a join of up to max_copied
+// commands takes a copy of it, and goes on along the chain while the budget
+// lasts, so a join copied into all its predecessors disappears. The blocks
+// left reachable from block 0 keep their order.
+void BasicBlockGraph::merge() {
+  const int32_t size = basic_blocks.size();
+  // where a jump to each block ends up, -1 before it is known and -2 while
+  // it is being followed; a loop of trampolines is entered at its first block
+  std::vector<int32_t> target(size, -1);
+  std::vector<int32_t> chain;
+  for (int32_t i = 0; i < size; ++i) {
+    int32_t t = i;
+    while (target[t] == -1 && t != 0 && basic_blocks[t].is_trampoline()) {
+      target[t] = -2;
+      chain.push_back(t);
+      t = basic_blocks[t].get_next_index().front();
+    }
+    if (target[t] < 0) target[t] = t;
+    for (const int32_t c : chain) target[c] = target[t];
+    chain.clear();
+  }
+  for (auto &bb : basic_blocks) bb.renumber(target);
+
+  std::vector<bool> alive(size, false);
+  std::vector<int32_t> preds(size, 0), queue(1, 0);
+  alive[0] = true;
+  preds[0] = 1;
+  for (size_t q = 0; q < queue.size(); ++q) {
+    for (const int32_t next : basic_blocks[queue[q]].get_next_index()) {
+      ++preds[next];
+      if (!alive[next]) {
+        alive[next] = true;
+        queue.push_back(next);
+      }
+    }
+  }
+  bool copied = false;
+  for (int32_t i = 0; i < size; ++i) {
+    if (!alive[i]) continue;
+    auto &bb = basic_blocks[i];
+    size_t budget = max_copied;
+    while (bb.get_next_index().size() == 1) {
+      const int32_t next = bb.get_next_index().front();
+      if (next == i) break;
+      if (preds[next] == 1) {
+        bb.append(basic_blocks[next]);
+        alive[next] = false;
+        continue;
+      }
+      // a short join is copied into the blocks that jump to it
+      const size_t length = std::max<size_t>(1, basic_blocks[next].get_commands().size());
+      if (length > budget) break;
+      budget -= length;
+      --preds[next];
+      for (const int32_t target : basic_blocks[next].get_next_index()) ++preds[target];
+      bb.append(basic_blocks[next]);
+      copied = true;
+    }
+  }
+  if (copied) {
+    // joins copied into all their predecessors are left unreachable
+    std::fill(begin(alive), end(alive), false);
+    alive[0] = true;
+    queue.assign(1, 0);
+    for (size_t q = 0; q < queue.size(); ++q) {
+      for (const int32_t next : basic_blocks[queue[q]].get_next_index()) {
+        if (!alive[next]) {
+          alive[next] = true;
+          queue.push_back(next);
         }
-        basic_blocks.back().set_nexts(next_index);
-        break;
-      } else {
-        old_ptr = ptr;
-        ptr = nexts.front();
       }
     }
   }
+  if (std::find(begin(alive), end(alive), false) == end(alive)) return;
+
+  std::vector<int32_t> renumber(size, -1);
+  size_t count = 0;
+  for (int32_t i = 0; i < size; ++i) {
+    if (!alive[i]) continue;
+    renumber[i] = count;
+    if (count != static_cast<size_t>(i)) basic_blocks[count] = std::move(basic_blocks[i]);
+    ++count;
+  }
+  basic_blocks.resize(count);
+  for (auto &bb : basic_blocks) bb.renumber(renumber);
 }
 
 void BasicBlockGraph::exec() const {
   int32_t index = 0;
   Stack stack;
+  if (depth_limit > 0) stack.reserve(depth_limit);
   while (index >= 0) {
     index = basic_blocks[index].exec(stack);
   }
 }
 
+void BasicBlockGraph::fuse(const std::set<Fusion> &patterns) {
+  if (patterns.empty()) return;
+  depth_limit = -1;
+  for (auto &bb : basic_blocks) {
+    bb.fuse(patterns);
+  }
+}
+
+void BasicBlockGraph::fold() {
+  depth_limit = -1;
+  for (auto &bb : basic_blocks) {
+    bb.fold();
+  }
+  // blocks whose commands cancel out are left as trampolines
+  merge();
+}
+
+void BasicBlockGraph::analyze_depth() {
+  const size_t size = basic_blocks.size();
+  std::vector<DepthRange> entry(size);
+  std::vector<bool> reached(size, false), queued(size, false);
+  std::vector<int32_t> raises(size, 0);
+  std::queue<size_t> q;
+  entry[0] = DepthRange { 0, 0 };
+  reached[0] = queued[0] = true;
+  q.push(0);
+  while (!q.empty()) {
+    const size_t index = q.front();
+    q.pop();
+    queued[index] = false;
+    DepthRange range = entry[index];
+    for (const auto &cmd : basic_blocks[index].get_commands()) {
+      step(*cmd, range);
+    }
+    for (const int32_t next : basic_blocks[index].get_next_index()) {
+      auto &target = entry[next];
+      bool changed = false;
+      if (!reached[next]) {
+        reached[next] = changed = true;
+        target = range;
+      }
+      if (range.min < target.min) {
+        target.min = range.min;
+        changed = true;
+      }
+      if (range.max > target.max) {
+        target.max = ++raises[next] > max_raises ? unbounded : range.max;
+        changed = true;
+      }
+      if (changed && !queued[next]) {
+        queued[next] = true;
+        q.push(next);
+      }
+    }
+  }
+  int32_t limit = 0;
+  for (size_t i = 0; i < size; ++i) {
+    if (!reached[i]) continue;
+    basic_blocks[i].set_entry_depth(entry[i].min);
+    DepthRange range = entry[i];
+    limit = std::max(limit, range.max);
+    for (const auto &cmd : basic_blocks[i].get_commands()) {
+      step(*cmd, range);
+      limit = std::max(limit, range.max);
+    }
+  }
+  depth_limit = limit == unbounded ? -1 : limit;
+}
+
+size_t BasicBlockGraph::unchecked_count() const {
+  size_t count = 0;
+  for (const auto &bb : basic_blocks) {
+    count += bb.unchecked_count();
+  }
+  return count;
+}
+
+size_t BasicBlockGraph::command_count() const {
+  size_t count = 0;
+  for (const auto &bb : basic_blocks) {
+    count += bb.get_commands().size();
+  }
+  return count;
+}
+
+std::vector<std::tuple<size_t, ConcreteCommandType, ConcreteCommandType>>
+    BasicBlockGraph::pair_frequency() const {
+  std::map<std::pair<ConcreteCommandType, ConcreteCommandType>, size_t> count;
+  for (const auto &bb : basic_blocks) {
+    const auto &commands = bb.get_commands();
+    for (size_t i = 1; i < commands.size(); ++i) {
+      ++count[std::make_pair(commands[i-1]->command_type(), commands[i]->command_type())];
+    }
+  }
+  std::vector<std::tuple<size_t, ConcreteCommandType, ConcreteCommandType>> res;
+  for (const auto &elem : count) {
+    res.emplace_back(elem.second, elem.first.first, elem.first.second);
+  }
+  std::sort(std::begin(res), std::end(res), [](const auto &lhs, const auto &rhs) {
+    return std::get<0>(lhs) > std::get<0>(rhs);
+  });
+  return res;
+}
+
 std::ostream& operator<<(std::ostream &os, const BasicBlockGraph &bbg) {
   os << "#include <cstdlib>\n";
   os << "#include \"lib/stack.hpp\"\n";
   os << "int main() {\n";
   os << "  Stack stack;\n";
+  if (bbg.depth_limit > 0) {
+    os << "  stack.reserve(" << bbg.depth_limit << ");\n";
+  }
   for (size_t i = 0; i < bbg.basic_blocks.size(); ++i) {
     os << "  label" << i << ":\n" << bbg.basic_blocks[i] << "\n";
   }
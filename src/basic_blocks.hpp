@@ -1,29 +1,110 @@
+#pragma once
+#include <algorithm>
 #include <array>
 #include <iostream>
+#include <map>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <tuple>
 #include <vector>
 #include "interpret.hpp"
 
+// Superinstruction patterns understood by BasicBlock::fuse
+enum class Fusion {
+  AddImm,         // Push n; Add
+  SubImm,         // Push n; Subtract
+  MulImm,         // Push n; Multiply
+  NotNot,         // Not; Not
+  RollConst,      // Push a; Push b; Roll
+  DupBranchZero   // Duplicate; Jez
+};
+
+// "all", "none" or a comma separated list such as "add_imm,roll_const"
+std::set<Fusion> parse_fusions(const std::string &);
+
+// Bounds of the stack depth at some point of the program
+struct DepthRange {
+  int32_t min;
+  int32_t max;  // std::numeric_limits<int32_t>::max() when unbounded
+};
+
+// Successor block indices of a block, indexed by the slot its last
+// command returns; held in place so that taking a branch touches no heap
+class Successors {
+ public:
+  Successors() : count(0), slots() {}
+  void push_back(const int32_t next) { slots[count++] = next; }
+  size_t size() const { return count; }
+  bool empty() const { return count == 0; }
+  int32_t front() const { return slots[0]; }
+  int32_t operator[](const size_t i) const { return slots[i]; }
+  int32_t at(const size_t i) const {
+    if (i >= count) throw std::out_of_range("Successors::at");
+    return slots[i];
+  }
+  int32_t *begin() { return slots.data(); }
+  int32_t *end() { return slots.data() + count; }
+  const int32_t *begin() const { return slots.data(); }
+  const int32_t *end() const { return slots.data() + count; }
+ private:
+  uint32_t count;
+  std::array<int32_t, CommandGraph::max_nexts> slots;
+};
+
 class BasicBlock {
  public:
   BasicBlock() = default;
   void push(const std::shared_ptr<Command> &cmd) {
     commands.push_back(cmd);
   }
-  void set_nexts(const std::vector<int32_t> &nexts) {
+  void set_nexts(const Successors &nexts) {
     next_index = nexts;
   }
+  // continues the block with the commands of its only successor
+  void append(const BasicBlock &next);
+  // maps the successors through index
+  void renumber(const std::vector<int32_t> &index);
+  // holds only Nops and has a single successor
+  bool is_trampoline() const;
   int32_t exec(Stack &) const;
+  void fuse(const std::set<Fusion> &patterns);
+  void fold();
+  // commands that cannot underflow with `depth` elements on entry skip their checks
+  void set_entry_depth(const int32_t depth);
+  size_t unchecked_count() const {
+    return std::count(std::begin(unchecked), std::end(unchecked), true);
+  }
+  const std::vector<std::shared_ptr<Command>> &get_commands() const { return commands; }
+  const Successors &get_next_index() const { return next_index; }
   friend std::ostream& operator<<(std::ostream &os, const BasicBlock &bb);
  private:
   std::vector<std::shared_ptr<Command>> commands;
-  std::vector<int32_t> next_index;
+  Successors next_index;
+  std::vector<bool> unchecked;
 };
 
 class BasicBlockGraph {
  public:
   explicit BasicBlockGraph(const CommandGraph &cg);
   void exec() const;
+  void fuse(const std::set<Fusion> &patterns);
+  // folds commands on constants and removes sequences without effect
+  void fold();
+  // bounds the stack depth at every block entry, so that commands which
+  // cannot underflow skip their checks; fuse and fold drop the result
+  void analyze_depth();
+  // -1 when the stack may grow without bound or before analyze_depth
+  int32_t max_depth() const { return depth_limit; }
+  size_t unchecked_count() const;
+  size_t command_count() const;
+  // static count of adjacent command pairs, most frequent first
+  std::vector<std::tuple<size_t, ConcreteCommandType, ConcreteCommandType>> pair_frequency() const;
+  size_t size() const { return basic_blocks.size(); }
+  const BasicBlock &operator[](const size_t index) const { return basic_blocks[index]; }
   friend std::ostream& operator<<(std::ostream &os, const BasicBlockGraph &bbg);
  private:
+  void merge();
   std::vector<BasicBlock> basic_blocks;
+  int32_t depth_limit = -1;
 };
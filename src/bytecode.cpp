@@ -0,0 +1,358 @@
+#include "bytecode.hpp"
+#include <iostream>
+#include <stdexcept>
+#include "io32.hpp"
+
+namespace {
+
+Instruction lower(const Command &cmd) {
+  switch (cmd.command_type()) {
+    case ConcreteCommandType::Switch:
+      return Instruction { Opcode::Switch, 0, 0 };
+    case ConcreteCommandType::Pointer:
+      return Instruction { Opcode::Pointer, 0, 0 };
+    case ConcreteCommandType::Jez:
+      return Instruction { Opcode::Jez, 0, 0 };
+    case ConcreteCommandType::Halt:
+      return Instruction { Opcode::Halt, 0, 0 };
+    case ConcreteCommandType::Push:
+      return Instruction { Opcode::Push, dynamic_cast<const Push &>(cmd).get_value(), 0 };
+    case ConcreteCommandType::Duplicate:
+      return Instruction { Opcode::Duplicate, 0, 0 };
+    case ConcreteCommandType::InNumber:
+      return Instruction { Opcode::InNumber, 0, 0 };
+    case ConcreteCommandType::InChar:
+      return Instruction { Opcode::InChar, 0, 0 };
+    case ConcreteCommandType::Pop:
+      return Instruction { Opcode::Pop, dynamic_cast<const Pop &>(cmd).get_count(), 0 };
+    case ConcreteCommandType::OutNumber:
+      return Instruction { Opcode::OutNumber, 0, 0 };
+    case ConcreteCommandType::OutChar:
+      return Instruction { Opcode::OutChar, 0, 0 };
+    case ConcreteCommandType::Add:
+      return Instruction { Opcode::Add, 0, 0 };
+    case ConcreteCommandType::Subtract:
+      return Instruction { Opcode::Subtract, 0, 0 };
+    case ConcreteCommandType::Multiply:
+      return Instruction { Opcode::Multiply, 0, 0 };
+    case ConcreteCommandType::Divide:
+      return Instruction { Opcode::Divide, 0, 0 };
+    case ConcreteCommandType::Modulo:
+      return Instruction { Opcode::Modulo, 0, 0 };
+    case ConcreteCommandType::Greater:
+      return Instruction { Opcode::Greater, 0, 0 };
+    case ConcreteCommandType::Not:
+      return Instruction { Opcode::Not, 0, 0 };
+    case ConcreteCommandType::Swap:
+      return Instruction { Opcode::Swap, 0, 0 };
+    case ConcreteCommandType::Roll:
+      return Instruction { Opcode::Roll, 0, 0 };
+    case ConcreteCommandType::AddImm:
+      return Instruction { Opcode::AddImm, dynamic_cast<const AddImm &>(cmd).get_value(), 0 };
+    case ConcreteCommandType::SubImm:
+      return Instruction { Opcode::SubImm, dynamic_cast<const SubImm &>(cmd).get_value(), 0 };
+    case ConcreteCommandType::MulImm:
+      return Instruction { Opcode::MulImm, dynamic_cast<const MulImm &>(cmd).get_value(), 0 };
+    case ConcreteCommandType::NotNot:
+      return Instruction { Opcode::NotNot, 0, 0 };
+    case ConcreteCommandType::RollConst:
+      {
+        const auto &roll = dynamic_cast<const RollConst &>(cmd);
+        return Instruction { Opcode::RollConst, roll.get_depth(), roll.get_iter() };
+      }
+    case ConcreteCommandType::DupBranchZero:
+      return Instruction { Opcode::DupBranchZero, 0, 0 };
+    default: throw std::domain_error("Cannot lower command to bytecode");
+  }
+}
+
+} // namespace
+
+Opcode lower_body(const BasicBlock &bb, std::vector<Instruction> &code, std::vector<int32_t> &pool) {
+  const auto &commands = bb.get_commands();
+  Opcode branch = Opcode::Jump;
+  switch (commands.back()->command_type()) {
+    case ConcreteCommandType::Switch:
+    case ConcreteCommandType::Jez:
+    case ConcreteCommandType::DupBranchZero:
+    case ConcreteCommandType::Pointer:
+    case ConcreteCommandType::Halt:
+      branch = lower(*commands.back()).op;
+      break;
+    default:
+      break;
+  }
+  const size_t body = commands.size() - (branch == Opcode::Jump ? 0 : 1);
+  for (size_t i = 0; i < body; ++i) {
+    const auto &cmd = commands[i];
+    switch (cmd->command_type()) {
+      case ConcreteCommandType::Nop:
+        break;
+      case ConcreteCommandType::PushArray:
+        {
+          const auto &data = dynamic_cast<const PushArray &>(*cmd).get_data();
+          code.push_back(Instruction { Opcode::PushArray,
+              static_cast<int32_t>(pool.size()), static_cast<int32_t>(data.size()) });
+          pool.insert(std::end(pool), std::begin(data), std::end(data));
+        }
+        break;
+      default:
+        code.push_back(lower(*cmd));
+    }
+  }
+  return branch;
+}
+
+Bytecode::Bytecode(const BasicBlockGraph &bbg) : code(), pool() {
+  // Branch operands hold block indices until every block has an offset
+  std::vector<int32_t> block_offset(bbg.size());
+  std::vector<size_t> code_fixups, pool_fixups;
+  for (size_t i = 0; i < bbg.size(); ++i) {
+    block_offset[i] = code.size();
+    const auto &next_index = bbg[i].get_next_index();
+    const Opcode branch = lower_body(bbg[i], code, pool);
+    switch (branch) {
+      case Opcode::Switch:
+      case Opcode::Jez:
+      case Opcode::DupBranchZero:
+        code.push_back(Instruction { branch, next_index.at(0), next_index.at(1) });
+        code_fixups.push_back(code.size() - 1);
+        break;
+      case Opcode::Pointer:
+        code.push_back(Instruction { branch, static_cast<int32_t>(pool.size()), 0 });
+        for (size_t j = 0; j < 4; ++j) {
+          pool_fixups.push_back(pool.size());
+          pool.push_back(next_index.at(j));
+        }
+        break;
+      case Opcode::Halt:
+        code.push_back(Instruction { Opcode::Halt, 0, 0 });
+        break;
+      default:
+        if (next_index.empty()) {
+          code.push_back(Instruction { Opcode::Halt, 0, 0 });
+        } else if (next_index.front() != static_cast<int32_t>(i + 1)) {
+          code.push_back(Instruction { Opcode::Jump, next_index.front(), 0 });
+          code_fixups.push_back(code.size() - 1);
+        }
+    }
+  }
+  for (size_t index : code_fixups) {
+    code[index].arg = block_offset[code[index].arg];
+    if (code[index].op != Opcode::Jump) {
+      code[index].aux = block_offset[code[index].aux];
+    }
+  }
+  for (size_t index : pool_fixups) {
+    pool[index] = block_offset[pool[index]];
+  }
+}
+
+void Bytecode::exec() const {
+  Stack stack;
+  run(code.data(), pool.data(), code.data(), stack);
+}
+
+// Token-threaded dispatch: every handler jumps straight to the handler of
+// the following instruction through the label table
+GuardExit run(const Instruction *base, const int32_t *pool, const Instruction *pc, Stack &stack) {
+  static const void * const labels[] = {
+    &&op_jump, &&op_jez, &&op_switch, &&op_pointer, &&op_halt,
+    &&op_push, &&op_push_array, &&op_duplicate, &&op_in_number, &&op_in_char,
+    &&op_pop, &&op_out_number, &&op_out_char, &&op_add, &&op_subtract,
+    &&op_multiply, &&op_divide, &&op_modulo, &&op_greater, &&op_not,
+    &&op_swap, &&op_roll, &&op_add_imm, &&op_sub_imm, &&op_mul_imm,
+    &&op_not_not, &&op_roll_const, &&op_dup_branch_zero, &&op_guard_jez, &&op_guard_switch,
+    &&op_guard_pointer, &&op_guard_dup_branch_zero, &&op_exit
+  };
+#define DISPATCH() goto *labels[static_cast<size_t>(pc->op)]
+#define NEXT() do { ++pc; DISPATCH(); } while (false)
+#define IMMEDIATE_OP(expr) \
+  if (!stack.empty()) { \
+    int32_t top = stack.top(); stack.pop(); \
+    stack.push(expr); \
+  } else { \
+    stack.push(pc->arg); \
+  } \
+  NEXT()
+#define BINARY_OP(expr) \
+  if (stack.size() >= 2) { \
+    int32_t rhs = stack.top(); stack.pop(); \
+    int32_t lhs = stack.top(); stack.pop(); \
+    stack.push(expr); \
+  } \
+  NEXT()
+// division by zero is ignored like any other invalid command
+#define DIVISION_OP(expr) \
+  if (stack.size() >= 2 && stack.top() != 0) { \
+    int32_t rhs = stack.top(); stack.pop(); \
+    int32_t lhs = stack.top(); stack.pop(); \
+    stack.push(expr); \
+  } \
+  NEXT()
+#define GUARD(slot) \
+  if ((slot) == pc->arg) NEXT(); \
+  return GuardExit { pc->aux, (slot) }
+  DISPATCH();
+op_jump:
+  pc = base + pc->arg;
+  DISPATCH();
+op_jez:
+  if (!stack.empty()) {
+    int32_t value = stack.top(); stack.pop();
+    pc = base + (value == 0 ? pc->aux : pc->arg);
+  } else {
+    pc = base + pc->arg;
+  }
+  DISPATCH();
+op_switch:
+  if (!stack.empty()) {
+    int32_t value = stack.top(); stack.pop();
+    pc = base + (mod(value, 2) ? pc->aux : pc->arg);
+  } else {
+    pc = base + pc->arg;
+  }
+  DISPATCH();
+op_pointer:
+  if (!stack.empty()) {
+    int32_t value = stack.top(); stack.pop();
+    pc = base + pool[pc->arg + mod(value, 4)];
+  } else {
+    pc = base + pool[pc->arg];
+  }
+  DISPATCH();
+op_halt:
+  return GuardExit { -1, 0 };
+op_push:
+  stack.push(pc->arg);
+  NEXT();
+op_push_array:
+  for (int32_t i = 0; i < pc->aux; ++i) stack.push(pool[pc->arg + i]);
+  NEXT();
+op_duplicate:
+  if (!stack.empty()) stack.push(stack.top());
+  NEXT();
+op_in_number:
+  stack.push(io32::getnumber());
+  NEXT();
+op_in_char:
+  stack.push(io32::getchar());
+  NEXT();
+op_pop:
+  for (int32_t i = 0; i < pc->arg && !stack.empty(); ++i) stack.pop();
+  NEXT();
+op_out_number:
+  if (!stack.empty()) {
+    io32::putnumber(stack.top());
+    stack.pop();
+  }
+  NEXT();
+op_out_char:
+  if (!stack.empty()) {
+    io32::putchar(stack.top());
+    stack.pop();
+  }
+  NEXT();
+op_add:
+  BINARY_OP(lhs + rhs);
+op_subtract:
+  BINARY_OP(lhs - rhs);
+op_multiply:
+  BINARY_OP(lhs * rhs);
+op_greater:
+  BINARY_OP(lhs > rhs ? 1 : 0);
+op_divide:
+  DIVISION_OP(lhs / rhs);
+op_modulo:
+  DIVISION_OP(lhs % rhs);
+op_not:
+  if (!stack.empty()) {
+    int32_t top = stack.top(); stack.pop();
+    stack.push(top ? 0 : 1);
+  }
+  NEXT();
+op_swap:
+  if (stack.size() >= 2) {
+    int32_t arg2 = stack.top(); stack.pop();
+    int32_t arg1 = stack.top(); stack.pop();
+    stack.push(arg2);
+    stack.push(arg1);
+  }
+  NEXT();
+op_roll:
+  if (stack.size() >= 2) {
+    int32_t iter = stack.top(); stack.pop();
+    int32_t depth = stack.top(); stack.pop();
+    if (depth >= 0 && stack.size() >= (size_t)depth) {
+      if (depth > 0) {
+        stack.roll(depth, mod(iter, depth));
+      }
+    } else {
+      stack.push(depth);
+      stack.push(iter);
+    }
+  }
+  NEXT();
+op_add_imm:
+  IMMEDIATE_OP(top + pc->arg);
+op_sub_imm:
+  IMMEDIATE_OP(top - pc->arg);
+op_mul_imm:
+  IMMEDIATE_OP(top * pc->arg);
+op_not_not:
+  if (!stack.empty()) {
+    int32_t top = stack.top(); stack.pop();
+    stack.push(top ? 1 : 0);
+  }
+  NEXT();
+op_roll_const:
+  if (pc->arg >= 0 && stack.size() >= (size_t)pc->arg) {
+    if (pc->arg > 0) {
+      stack.roll(pc->arg, mod(pc->aux, pc->arg));
+    }
+  } else {
+    stack.push(pc->arg);
+    stack.push(pc->aux);
+  }
+  NEXT();
+op_dup_branch_zero:
+  pc = base + (!stack.empty() && stack.top() == 0 ? pc->aux : pc->arg);
+  DISPATCH();
+op_guard_jez:
+  {
+    int32_t slot = 0;
+    if (!stack.empty()) {
+      slot = stack.top() == 0 ? 1 : 0;
+      stack.pop();
+    }
+    GUARD(slot);
+  }
+op_guard_switch:
+  {
+    int32_t slot = 0;
+    if (!stack.empty()) {
+      slot = mod(stack.top(), 2);
+      stack.pop();
+    }
+    GUARD(slot);
+  }
+op_guard_pointer:
+  {
+    int32_t slot = 0;
+    if (!stack.empty()) {
+      slot = mod(stack.top(), 4);
+      stack.pop();
+    }
+    GUARD(slot);
+  }
+op_guard_dup_branch_zero:
+  GUARD(!stack.empty() && stack.top() == 0 ? 1 : 0);
+op_exit:
+  return GuardExit { pc->aux, 0 };
+#undef GUARD
+#undef IMMEDIATE_OP
+#undef DIVISION_OP
+#undef BINARY_OP
+#undef NEXT
+#undef DISPATCH
+}
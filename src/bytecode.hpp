@@ -0,0 +1,77 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include "basic_blocks.hpp"
+
+enum class Opcode : uint8_t {
+  Jump,
+  Jez,
+  Switch,
+  Pointer,
+  Halt,
+  Push,
+  PushArray,
+  Duplicate,
+  InNumber,
+  InChar,
+  Pop,
+  OutNumber,
+  OutChar,
+  Add,
+  Subtract,
+  Multiply,
+  Divide,
+  Modulo,
+  Greater,
+  Not,
+  Swap,
+  Roll,
+  AddImm,
+  SubImm,
+  MulImm,
+  NotNot,
+  RollConst,
+  DupBranchZero,
+  GuardJez,
+  GuardSwitch,
+  GuardPointer,
+  GuardDupBranchZero,
+  Exit
+};
+
+// Branch operands are instruction offsets into the code array.
+// Jez/Switch/DupBranchZero: arg = slot 0, aux = slot 1
+// Pointer: arg = offset of 4 targets in the pool
+// PushArray: arg = offset in the pool, aux = element count
+// Push and *Imm: arg = value, Pop: arg = count
+// RollConst: arg = depth, aux = iter
+// Guard*: arg = expected successor slot (-1 never matches), aux = block index
+// Exit: aux = block index, leaves through slot 0
+struct Instruction {
+  Opcode op;
+  int32_t arg;
+  int32_t aux;
+};
+
+// Where run() stopped: the successor slot of the block whose guard failed
+struct GuardExit {
+  int32_t block;  // -1 after Halt
+  int32_t slot;
+};
+
+// Appends every command of bb but the branch that ends it, and returns the
+// opcode of that branch (Jump when the block just falls through)
+Opcode lower_body(const BasicBlock &bb, std::vector<Instruction> &code, std::vector<int32_t> &pool);
+
+// Runs from pc until Halt, Exit or a failing guard
+GuardExit run(const Instruction *base, const int32_t *pool, const Instruction *pc, Stack &stack);
+
+class Bytecode {
+ public:
+  explicit Bytecode(const BasicBlockGraph &bbg);
+  void exec() const;
+  size_t size() const { return code.size(); }
+ private:
+  std::vector<Instruction> code;
+  std::vector<int32_t> pool;
+};
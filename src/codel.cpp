@@ -1,71 +1,370 @@
 #include "codel.hpp"
+#include <array>
+#include <csetjmp>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <numeric>
+#if defined(__SSE4_1__)
+#include <immintrin.h>
+#endif
 
-Color pixel_to_Color(const png::rgb_pixel &pixel) {
-  auto red = pixel.red;
-  auto green = pixel.green;
-  auto blue = pixel.blue;
-  int red_p, green_p, blue_p;
-  switch (red) {
-    case 0: red_p = 0; break;
-    case 0xC0: red_p = 1; break;
-    case 0xFF: red_p = 2; break;
-    default: return unknown_color();
-  }
-  switch (green) {
-    case 0: green_p = 0; break;
-    case 0xC0: green_p = 1; break;
-    case 0xFF: green_p = 2; break;
-    default: return unknown_color();
-  }
-  switch (blue) {
-    case 0: blue_p = 0; break;
-    case 0xC0: blue_p = 1; break;
-    case 0xFF: blue_p = 2; break;
-    default: return unknown_color();
-  }
-  int all_p = red_p + green_p * 3 + blue_p * 9;
-  switch (all_p) {
-    case 0: // 000000
-      return Color { Hue::BLACK, Brightness::BLACK };
-    case 1: // C00000
-      return Color { Hue::RED, Brightness::DARK };
-    case 2: // FF0000
-      return Color { Hue::RED, Brightness::NORMAL };
-    case 3: // 00C000
-      return Color { Hue::GREEN, Brightness::DARK };
-    case 4: // C0C000
-      return Color { Hue::YELLOW, Brightness::DARK };
-    case 6: // 00FF00
-      return Color { Hue::GREEN, Brightness::NORMAL };
-    case 8: // FFFF00
-      return Color { Hue::YELLOW, Brightness::NORMAL };
-    case 9: // 0000C0
-      return Color { Hue::BLUE, Brightness::DARK };
-    case 10: // C000C0
-      return Color { Hue::MAGENTA, Brightness::DARK };
-    case 12: // 00C0C0
-      return Color { Hue::CYAN, Brightness::DARK };
-    case 14: // FFC0C0
-      return Color { Hue::RED, Brightness::LIGHT };
-    case 16: // C0FFC0
-      return Color { Hue::GREEN, Brightness::LIGHT };
-    case 17: // FFFFC0
-      return Color { Hue::YELLOW, Brightness::LIGHT };
-    case 18: // 0000FF
-      return Color { Hue::BLUE, Brightness::NORMAL };
-    case 20: // FF00FF
-      return Color { Hue::MAGENTA, Brightness::NORMAL };
-    case 22: // C0C0FF
-      return Color { Hue::BLUE, Brightness::LIGHT };
-    case 23: // FFC0FF
-      return Color { Hue::MAGENTA, Brightness::LIGHT };
-    case 24: // 00FFFF
-      return Color { Hue::CYAN, Brightness::NORMAL };
-    case 25: // C0FFFF
-      return Color { Hue::CYAN, Brightness::LIGHT };
-    case 26: // FFFFFF
-      return Color { Hue::WHITE, Brightness::WHITE };
-    default:
-      return unknown_color();
+namespace {
+
+// indexed by red + green * 3 + blue * 9 with 00, C0, FF as 0, 1, 2,
+// padded to two 16-byte halves for the vector lookup
+alignas(16) constexpr Codel codels[32] = {
+  black_codel, 2, 1, 8, 5, unknown_codel, 7, unknown_codel, 4,
+  14, 17, unknown_codel, 11, unknown_codel, 0, unknown_codel, 6, 3,
+  13, unknown_codel, 16, unknown_codel, 12, 15, 10, 9, white_codel,
+  unknown_codel, unknown_codel, unknown_codel, unknown_codel, unknown_codel
+};
+
+} // namespace
+
+Codel pixel_to_codel(const png::rgb_pixel &pixel) {
+  int levels[3];
+  const png::byte channels[3] = { pixel.red, pixel.green, pixel.blue };
+  for (int k = 0; k < 3; ++k) {
+    switch (channels[k]) {
+      case 0: levels[k] = 0; break;
+      case 0xC0: levels[k] = 1; break;
+      case 0xFF: levels[k] = 2; break;
+      default: return unknown_codel;
+    }
+  }
+  return codels[levels[0] + levels[1] * 3 + levels[2] * 9];
+}
+
+void classify_pixels_scalar(const png::byte *rgb, const size_t count, const size_t step, Codel *out) {
+  for (size_t j = 0; j < count; ++j) {
+    const png::byte *p = rgb + j * step * 3;
+    out[j] = pixel_to_codel(png::rgb_pixel(p[0], p[1], p[2]));
+  }
+}
+
+#if defined(__SSE4_1__)
+
+namespace {
+
+// Vectors of 16 codels from 48 bytes of RGB, or two such groups on AVX2
+// (one per 128-bit lane, since byte shuffles do not cross lanes).
+// Each byte becomes its level 0/1/2 for 00/C0/FF and 0x80 otherwise; the
+// levels are deinterleaved and summed as r + 3g + 9b with saturation, so any
+// invalid channel leaves the top bit set. Two 16-entry shuffles then look up
+// the codel and the top bit selects unknown_codel.
+template <size_t Bytes>
+struct Simd;
+
+template <>
+struct Simd<16> {
+  using V = __m128i;
+  static constexpr size_t pixels = 16;
+  static V set1(const char c) { return _mm_set1_epi8(c); }
+  static V set16(const void *t) { return _mm_loadu_si128(reinterpret_cast<const V *>(t)); }
+  static V load(const png::byte *p, const size_t chunk) {
+    return _mm_loadu_si128(reinterpret_cast<const V *>(p + chunk * 16));
+  }
+  static void store(Codel *out, const V v) { _mm_storeu_si128(reinterpret_cast<V *>(out), v); }
+  static V eq(const V a, const V b) { return _mm_cmpeq_epi8(a, b); }
+  static V gt(const V a, const V b) { return _mm_cmpgt_epi8(a, b); }
+  static V and_(const V a, const V b) { return _mm_and_si128(a, b); }
+  static V or_(const V a, const V b) { return _mm_or_si128(a, b); }
+  static V andnot(const V a, const V b) { return _mm_andnot_si128(a, b); }
+  static V adds(const V a, const V b) { return _mm_adds_epu8(a, b); }
+  static V shuffle(const V a, const V b) { return _mm_shuffle_epi8(a, b); }
+  static V blend(const V a, const V b, const V mask) { return _mm_blendv_epi8(a, b, mask); }
+};
+
+#if defined(__AVX2__)
+template <>
+struct Simd<32> {
+  using V = __m256i;
+  static constexpr size_t pixels = 32;
+  static V set1(const char c) { return _mm256_set1_epi8(c); }
+  static V set16(const void *t) {
+    return _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i *>(t)));
+  }
+  static V load(const png::byte *p, const size_t chunk) {
+    return _mm256_loadu2_m128i(reinterpret_cast<const __m128i *>(p + 48 + chunk * 16),
+                               reinterpret_cast<const __m128i *>(p + chunk * 16));
+  }
+  static void store(Codel *out, const V v) { _mm256_storeu_si256(reinterpret_cast<V *>(out), v); }
+  static V eq(const V a, const V b) { return _mm256_cmpeq_epi8(a, b); }
+  static V gt(const V a, const V b) { return _mm256_cmpgt_epi8(a, b); }
+  static V and_(const V a, const V b) { return _mm256_and_si256(a, b); }
+  static V or_(const V a, const V b) { return _mm256_or_si256(a, b); }
+  static V andnot(const V a, const V b) { return _mm256_andnot_si256(a, b); }
+  static V adds(const V a, const V b) { return _mm256_adds_epu8(a, b); }
+  static V shuffle(const V a, const V b) { return _mm256_shuffle_epi8(a, b); }
+  static V blend(const V a, const V b, const V mask) { return _mm256_blendv_epi8(a, b, mask); }
+};
+#endif
+
+// byte positions of one channel within the three 16-byte chunks, -1 = none
+constexpr char deinterleave[3][3][16] = {
+  { // red
+    {0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    {-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1},
+    {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13},
+  }, { // green
+    {1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    {-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1},
+    {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14},
+  }, { // blue
+    {2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    {-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1},
+    {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15},
+  }
+};
+
+template <size_t Bytes>
+size_t classify_simd(const png::byte *rgb, const size_t count, Codel *out) {
+  using S = Simd<Bytes>;
+  using V = typename S::V;
+  const V zero = S::set1(0), c0 = S::set1(static_cast<char>(0xC0)), ff = S::set1(static_cast<char>(0xFF));
+  const V one = S::set1(1), two = S::set1(2), invalid = S::set1(static_cast<char>(0x80));
+  const V fifteen = S::set1(15), unknown = S::set1(unknown_codel);
+  const V low = S::set16(codels), high = S::set16(codels + 16);
+  V masks[3][3];
+  for (int c = 0; c < 3; ++c) {
+    for (int k = 0; k < 3; ++k) masks[c][k] = S::set16(deinterleave[c][k]);
+  }
+  size_t j = 0;
+  for (; j + S::pixels <= count; j += S::pixels, rgb += S::pixels * 3) {
+    V levels[3];
+    for (int k = 0; k < 3; ++k) {
+      const V v = S::load(rgb, k);
+      const V is_c0 = S::eq(v, c0), is_ff = S::eq(v, ff);
+      const V valid = S::or_(S::eq(v, zero), S::or_(is_c0, is_ff));
+      levels[k] = S::or_(S::or_(S::and_(is_c0, one), S::and_(is_ff, two)), S::andnot(valid, invalid));
+    }
+    V channel[3];
+    for (int c = 0; c < 3; ++c) {
+      channel[c] = S::or_(S::shuffle(levels[0], masks[c][0]),
+          S::or_(S::shuffle(levels[1], masks[c][1]), S::shuffle(levels[2], masks[c][2])));
+    }
+    const V g3 = S::adds(S::adds(channel[1], channel[1]), channel[1]);
+    const V b2 = S::adds(channel[2], channel[2]);
+    const V b8 = S::adds(S::adds(b2, b2), S::adds(b2, b2));
+    const V index = S::adds(channel[0], S::adds(g3, S::adds(b8, channel[2])));
+    const V codel = S::blend(S::shuffle(low, index), S::shuffle(high, index), S::gt(index, fifteen));
+    S::store(out + j, S::blend(codel, unknown, index));
+  }
+  return j;
+}
+
+} // namespace
+
+void classify_pixels(const png::byte *rgb, const size_t count, const size_t step, Codel *out) {
+  if (step != 1) {
+    classify_pixels_scalar(rgb, count, step, out);
+    return;
+  }
+#if defined(__AVX2__)
+  size_t done = classify_simd<32>(rgb, count, out);
+#else
+  size_t done = 0;
+#endif
+  done += classify_simd<16>(rgb + done * 3, count - done, out + done);
+  classify_pixels_scalar(rgb + done * 3, count - done, 1, out + done);
+}
+
+#else
+
+void classify_pixels(const png::byte *rgb, const size_t count, const size_t step, Codel *out) {
+  classify_pixels_scalar(rgb, count, step, out);
+}
+
+#endif
+
+namespace {
+
+// folds row i's colour changes into g, comparing against the row above
+size_t boundary_gcd(const Codel *row, const Codel *above, const size_t width, const size_t i, size_t g) {
+  if (above != nullptr && i % g != 0 && std::memcmp(row, above, width) != 0) {
+    g = std::gcd(g, i);
+  }
+  for (size_t j = 1; j < width && g > 1; ++j) {
+    if (row[j] != row[j-1] && j % g != 0) g = std::gcd(g, j);
+  }
+  return g;
+}
+
+} // namespace
+
+size_t detect_codel_size(const Grid<Codel> &pixels) {
+  size_t size = std::gcd(pixels.width(), pixels.height());
+  if (size <= 1) return 1;
+  const size_t start = size;
+#pragma omp parallel
+  {
+    size_t local = start;
+#pragma omp for nowait
+    for (size_t i = 0; i < pixels.height(); ++i) {
+      if (local > 1) local = boundary_gcd(pixels.row_data(i), i > 0 ? pixels.row_data(i-1) : nullptr, pixels.width(), i, local);
+    }
+#pragma omp critical
+    size = std::gcd(size, local);
+  }
+  return size;
+}
+
+namespace {
+
+struct StreamState {
+  CodelTable &table;
+  size_t codel_size;
+  size_t width;                         // in pixels
+  bool interlaced;
+  std::vector<std::vector<png_byte>> rows; // sampled rows, interlaced images only
+  bool complete;
+  bool indexed;                         // rows hold palette indices
+  std::array<Codel, 256> palette;
+  // uniformity check of non-interlaced images read at a codel size > 1,
+  // which needs every row and not just the sampled ones
+  bool scan;
+  size_t uniform;
+  std::vector<Codel> current, previous;
+};
+
+void classify_row(const StreamState &state, const png_byte *row, Codel *codels, const size_t count, const size_t step) {
+  if (state.indexed) {
+    for (size_t j = 0; j < count; ++j) {
+      codels[j] = state.palette[row[j * step]];
+    }
+    return;
+  }
+  classify_pixels(row, count, step, codels);
+}
+
+void classify_row(const StreamState &state, const png_byte *row, const size_t i) {
+  classify_row(state, row, state.table.table.row_data(i), state.table.width(), state.codel_size);
+}
+
+void scan_row(StreamState &state, const png_byte *row, const size_t i) {
+  // once the gcd is not a multiple of the codel size it never will be
+  if (state.uniform % state.codel_size != 0) return;
+  classify_row(state, row, state.current.data(), state.width, 1);
+  state.uniform = boundary_gcd(state.current.data(), i > 0 ? state.previous.data() : nullptr, state.width, i, state.uniform);
+  state.current.swap(state.previous);
+}
+
+// Classifies the palette once; indices past its end expand to black in libpng
+void read_palette(png_structp png, png_infop info, StreamState &state) {
+  png_colorp colors = nullptr;
+  int count = 0;
+  png_get_PLTE(png, info, &colors, &count);
+  state.palette.fill(black_codel);
+  for (int k = 0; k < count && k < 256; ++k) {
+    state.palette[k] = pixel_to_codel(png::rgb_pixel(colors[k].red, colors[k].green, colors[k].blue));
+  }
+}
+
+// exceptions cannot unwind through libpng, so the message is kept and
+// control jumps back to the reader, which throws it
+void on_error(png_structp png, png_const_charp message) {
+  *static_cast<std::string *>(png_get_error_ptr(png)) = message;
+  std::longjmp(png_jmpbuf(png), 1);
+}
+
+void on_info(png_structp png, png_infop info) {
+  auto &state = *static_cast<StreamState *>(png_get_progressive_ptr(png));
+  state.indexed = png_get_color_type(png, info) == PNG_COLOR_TYPE_PALETTE;
+  if (state.indexed) {
+    read_palette(png, info, state);
+    png_set_packing(png);
+  } else {
+    png_set_expand(png);
+    png_set_strip_16(png);
+    png_set_strip_alpha(png);
+    png_set_gray_to_rgb(png);
+  }
+  state.interlaced = png_set_interlace_handling(png) > 1;
+  png_read_update_info(png, info);
+  state.width = png_get_image_width(png, info);
+  const size_t width = state.width / state.codel_size;
+  const size_t height = png_get_image_height(png, info) / state.codel_size;
+  state.table.table = Grid<Codel>(width, height);
+  if (state.interlaced) {
+    state.rows.assign(height, std::vector<png_byte>(png_get_rowbytes(png, info)));
+  }
+  state.scan = !state.interlaced && state.codel_size > 1;
+  if (state.scan) {
+    state.uniform = std::gcd(state.width, static_cast<size_t>(png_get_image_height(png, info)));
+    state.current.resize(state.width);
+    state.previous.resize(state.width);
+  }
+}
+
+void on_row(png_structp png, png_bytep row, png_uint_32 row_num, int) {
+  auto &state = *static_cast<StreamState *>(png_get_progressive_ptr(png));
+  if (row == nullptr) return;
+  if (state.scan) scan_row(state, row, row_num);
+  if (row_num % state.codel_size != 0) return;
+  const size_t i = row_num / state.codel_size;
+  if (i >= state.table.height()) return;
+  if (state.interlaced) {
+    png_progressive_combine_row(png, state.rows[i].data(), row);
+  } else {
+    classify_row(state, row, i);
+  }
+}
+
+void on_end(png_structp png, png_infop) {
+  static_cast<StreamState *>(png_get_progressive_ptr(png))->complete = true;
+}
+
+} // namespace
+
+CodelTable::CodelTable(const std::string &filename, const size_t codel_size, const GridLayout layout)
+  : table(), size(codel_size), uniform(0) {
+  // detection reads every pixel and samples them afterwards
+  const bool detect = codel_size == 0;
+  std::unique_ptr<FILE, int (*)(FILE *)> file(std::fopen(filename.c_str(), "rb"), &std::fclose);
+  if (!file) throw png::error("cannot open " + filename);
+  std::string error;
+  png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, &error, on_error, nullptr);
+  if (png == nullptr) throw png::error("png_create_read_struct failed");
+  png_infop info = png_create_info_struct(png);
+  StreamState state { *this, detect ? 1 : codel_size, 0, false, {}, false, false, {}, false, 0, {}, {} };
+  try {
+    if (info == nullptr) throw png::error("png_create_info_struct failed");
+    png_set_progressive_read_fn(png, &state, on_info, on_row, on_end);
+    std::vector<png_byte> chunk(1 << 16);
+    if (setjmp(png_jmpbuf(png))) throw png::error(error);
+    size_t read;
+    while ((read = std::fread(chunk.data(), 1, chunk.size(), file.get())) > 0) {
+      png_process_data(png, info, chunk.data(), read);
+    }
+    if (!state.complete) throw png::error(filename + ": unexpected end of file");
+  } catch (...) {
+    png_destroy_read_struct(&png, &info, nullptr);
+    throw;
+  }
+  png_destroy_read_struct(&png, &info, nullptr);
+#pragma omp parallel for
+  for (size_t i = 0; i < state.rows.size(); ++i) {
+    classify_row(state, state.rows[i].data(), i);
+  }
+  if (state.scan) {
+    uniform = state.uniform;
+  } else if (state.codel_size == 1) {
+    uniform = detect_codel_size(table);
+  }
+  if (detect) {
+    size = uniform;
+  }
+  if (size > 1 && detect) {
+    Grid<Codel> codels(table.width() / size, table.height() / size, Codel(), layout);
+#pragma omp parallel for
+    for (size_t i = 0; i < codels.height(); ++i) {
+      for (size_t j = 0; j < codels.width(); ++j) {
+        codels[i][j] = table[i * size][j * size];
+      }
+    }
+    table = std::move(codels);
+  } else if (layout != table.layout()) {
+    table = table.relayout(layout);
   }
 }
@@ -1,28 +1,47 @@
 #pragma once
 #include <cstddef>
+#include <string>
 #include <vector>
 #include "utils.hpp"
 
-std::size_t detect_codel_size(const Image &);
+Codel pixel_to_codel(const png::rgb_pixel &);
 
-Color pixel_to_Color(const png::rgb_pixel &);
+// Codels of `count` packed RGB pixels taken `step` pixels apart.
+// Contiguous runs go through SSE4.1/AVX2 when the target has them.
+void classify_pixels(const png::byte *rgb, const size_t count, const size_t step, Codel *out);
+void classify_pixels_scalar(const png::byte *rgb, const size_t count, const size_t step, Codel *out);
+
+// Largest size that splits a row-major grid into uniform squares: the gcd of its
+// dimensions and of every offset where the colour changes along a row or
+// down a column.
+size_t detect_codel_size(const Grid<Codel> &);
 
 class CodelTable {
  public:
-  CodelTable(const Image &image, const size_t codel_size) {
-    size_t width = image.get_width() / codel_size;
-    size_t height = image.get_height() / codel_size;
-    table = std::vector<std::vector<Color>>(height, std::vector<Color>(width));
-    for (size_t i = 0; i < height; ++i) {
-      for (size_t j = 0; j < width; ++j) {
-        auto pixel = image[i*codel_size][j*codel_size];
-        table[i][j] = pixel_to_Color(pixel);
-      }
+  CodelTable(const Image &image, const size_t codel_size, const GridLayout layout = GridLayout::rows)
+    : table(image.get_width() / codel_size, image.get_height() / codel_size), size(codel_size), uniform(0) {
+    static_assert(sizeof(png::rgb_pixel) == 3, "rows must be packed RGB");
+#pragma omp parallel for
+    for (size_t i = 0; i < table.height(); ++i) {
+      const auto *row = reinterpret_cast<const png::byte *>(image[i*codel_size].data());
+      classify_pixels(row, table.width(), codel_size, table.row_data(i));
     }
+    if (layout != table.layout()) table = table.relayout(layout);
   }
-  size_t height() const { return table.size(); }
-  size_t width() const { return table[0].size(); }
-  std::vector<Color> &operator[](const size_t i) { return table[i]; }
-  const std::vector<Color> &operator[](const size_t i) const { return table[i]; }
-  std::vector<std::vector<Color>> table;
+  // Decodes the file row by row and keeps only the rows holding codels.
+  // A codel size of 0 is detected from the whole image instead.
+  CodelTable(const std::string &filename, const size_t codel_size = 0, const GridLayout layout = GridLayout::rows);
+  size_t height() const { return table.height(); }
+  size_t width() const { return table.width(); }
+  size_t codel_size() const { return size; }
+  // detect_codel_size of the image, 0 if it was not checked; codels are
+  // uniform iff the codel size divides it
+  size_t uniform_size() const { return uniform; }
+  GridLayout layout() const { return table.layout(); }
+  Grid<Codel>::Row<Codel> operator[](const size_t i) { return table[i]; }
+  Grid<Codel>::Row<const Codel> operator[](const size_t i) const { return table[i]; }
+  Grid<Codel> table;
+ private:
+  size_t size;
+  size_t uniform;
 };
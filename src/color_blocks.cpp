@@ -12,55 +12,110 @@ ColorBlock::index_t ColorBlock::get_next_block(uint8_t dp, uint8_t cc) const {
   return next_blocks[dp * 2 + cc];
 }
 
-std::tuple<std::vector<Bound>, std::vector<int32_t>> get_bounds(
-    const FillMap &fill_map, const size_t width, const size_t height) {
-  std::vector<Bound> bounds(fill_map.index_count(), Bound(width, height));
-  std::vector<int32_t> count(fill_map.index_count(), 0);
+bool PathSet::insert(const size_t state) {
+  if ((used.size() + 1) * 2 > slots.size()) grow();
+  const size_t mask = slots.size() - 1;
+  size_t slot = (state * 0x9E3779B97F4A7C15ull >> 20) & mask;
+  while (slots[slot] != empty) {
+    if (slots[slot] == state) return false;
+    slot = (slot + 1) & mask;
+  }
+  slots[slot] = state;
+  used.push_back(slot);
+  states_.push_back(state);
+  return true;
+}
+
+void PathSet::grow() {
+  slots.assign(slots.size() * 2, empty);
+  used.clear();
+  const std::vector<size_t> states = std::move(states_);
+  states_.clear();
+  for (const size_t state : states) insert(state);
+}
+
+SlideTable::SlideTable(const CodelTable &table, const bool on_demand)
+  : table(table), on_demand(on_demand), runs() {
+  if (on_demand) return;
+  const size_t width = table.width(), height = table.height();
+  for (auto &grid : runs) grid = Grid<int32_t>(width, height);
+  auto &right = runs[0], &down = runs[1], &left = runs[2], &up = runs[3];
+#pragma omp parallel for
   for (size_t i = 0; i < height; ++i) {
+    const auto row = table[i];
     for (size_t j = 0; j < width; ++j) {
-      if (fill_map.get_index(j, i) >= 0) {
-        bounds[fill_map.get_index(j, i)].update(j, i);
-        ++count[fill_map.get_index(j, i)];
+      left[i][j] = is_white(row[j]) ? (j > 0 ? left[i][j-1] : 0) + 1 : 0;
+    }
+    for (size_t j = width; j-- > 0;) {
+      right[i][j] = is_white(row[j]) ? (j + 1 < width ? right[i][j+1] : 0) + 1 : 0;
+    }
+  }
+  // columns are scanned a row at a time, a strip of columns per thread
+  constexpr size_t strip = 256;
+#pragma omp parallel for
+  for (size_t first = 0; first < width; first += strip) {
+    const size_t last = std::min(width, first + strip);
+    for (size_t i = 0; i < height; ++i) {
+      for (size_t j = first; j < last; ++j) {
+        up[i][j] = is_white(table[i][j]) ? (i > 0 ? up[i-1][j] : 0) + 1 : 0;
+      }
+    }
+    for (size_t i = height; i-- > 0;) {
+      for (size_t j = first; j < last; ++j) {
+        down[i][j] = is_white(table[i][j]) ? (i + 1 < height ? down[i+1][j] : 0) + 1 : 0;
       }
     }
   }
-  return std::make_tuple(std::move(bounds), std::move(count));
 }
 
-// Lockless write
-// x86_64 guarantee 8byte aligned 8byte write atomically
-void write_cache(
-    cache_t<ColorBlock::index_t> &cache,
-    std::vector<std::tuple<size_t, size_t, uint8_t, uint8_t>> &&s,
-    const ColorBlock::index_t &res) {
-  for (auto &&t : s) {
-    auto [x, y, dp, cc] = t;
-    cache[y][x][dp][cc] = res;
+int32_t SlideTable::measure(size_t x, size_t y, const uint8_t dp) const {
+  const int dx[] = {1, 0, -1, 0};
+  const int dy[] = {0, 1, 0, -1};
+  int32_t run = 0;
+  while (x < table.width() && y < table.height() && is_white(table[y][x])) {
+    ++run;
+    x += dx[dp];
+    y += dy[dp];
   }
+  return run;
 }
 
+namespace {
+
+void write_cache(TransitionCache &cache, PathSet &path, const ColorBlock::index_t &res) {
+  for (const size_t state : path.states()) cache.store(state, res);
+  path.clear();
+}
+
+} // namespace
+
 ColorBlock::index_t search(size_t width, size_t height,
-    int64_t x, int64_t y, uint8_t dp, uint8_t cc, const FillMap &fm,
-    cache_t<ColorBlock::index_t> &cache,
-    cache_t<bool> &visit) {
+    int64_t x, int64_t y, uint8_t dp, uint8_t cc, FillMap &fm,
+    const SlideTable &slides, TransitionCache &cache, PathSet &path) {
   int dx[] = {1, 0, -1, 0};
   int dy[] = {0, 1, 0, -1};
-  std::vector<std::tuple<size_t, size_t, uint8_t, uint8_t>> s;
-  s.reserve(8);
   bool first = true;
   while (true) {
-    auto elem = cache[y][x][dp][cc];
+    const size_t state = cache.state(x, y, dp, cc);
+    auto elem = cache.load(state);
     if (std::get<4>(elem)) {
-      write_cache(cache, std::move(s), elem);
+      write_cache(cache, path, elem);
       return elem;
     }
-    if (visit[y][x][dp][cc]) {
+    if (!path.insert(state)) {
       ColorBlock::index_t res(-1, 0, 0, true, true);
-      write_cache(cache, std::move(s), res);
+      write_cache(cache, path, res);
       return res;
     }
-    s.emplace_back(x, y, dp, cc);
-    visit[y][x][dp][cc] = true;
+    // skip to the last white codel of a straight stretch; loops are still
+    // found since they pass through the turning states
+    const int32_t slide = slides.get(x, y, dp) - 1;
+    if (slide > 0) {
+      x += dx[dp] * slide;
+      y += dy[dp] * slide;
+      first = false;
+      continue;
+    }
     int64_t nx = x + dx[dp];
     int64_t ny = y + dy[dp];
     if (nx < 0 || ny < 0 || nx >= (int64_t)width || ny >= (int64_t)height
@@ -71,12 +126,12 @@ ColorBlock::index_t search(size_t width, size_t height,
         dp %= 4;
       } else {
         ColorBlock::index_t res(-1, 0, 0, false, true);
-        write_cache(cache, std::move(s), res);
+        write_cache(cache, path, res);
         return res;
       }
     } else if (fm.is_color(nx, ny)) {
-      ColorBlock::index_t res(fm.get_index(nx, ny), dp, cc, first, true);
-      write_cache(cache, std::move(s), res);
+      ColorBlock::index_t res(fm.label(nx, ny), dp, cc, first, true);
+      write_cache(cache, path, res);
       return res;
     } else {
       x = nx;
@@ -85,3 +140,22 @@ ColorBlock::index_t search(size_t width, size_t height,
     first = false;
   }
 }
+
+void ColorBlockGraph::link(const size_t index, const Bound &bound, FillMap &fill_map,
+    const SlideTable &slides, TransitionCache &cache, PathSet &path) {
+  const size_t width = slides.width(), height = slides.height();
+  // the codel each (dp, cc) leaves the block from
+  const size_t exits[8][2] = {
+    { bound.right, bound.right_r.min }, { bound.right, bound.right_r.max },
+    { bound.bottom_r.max, bound.bottom }, { bound.bottom_r.min, bound.bottom },
+    { bound.left, bound.left_r.max }, { bound.left, bound.left_r.min },
+    { bound.top_r.min, bound.top }, { bound.top_r.max, bound.top },
+  };
+  for (uint8_t dp = 0; dp < 4; ++dp) {
+    for (uint8_t cc = 0; cc < 2; ++cc) {
+      const auto &exit = exits[dp * 2 + cc];
+      const auto next = search(width, height, exit[0], exit[1], dp, cc, fill_map, slides, cache, path);
+      blocks[index].set_next_block(next, dp, cc);
+    }
+  }
+}
@@ -1,168 +1,178 @@
 #pragma once
 #include <cassert>
 #include <array>
+#include <atomic>
+#include <cstdint>
 #include <set>
 #include <tuple>
+#include <unordered_map>
 #include <vector>
 #include <omp.h>
 #include "codel.hpp"
 #include "fillmap.hpp"
 
-class Range {
- public:
-  Range(const size_t min, const size_t max)
-    : min(min), max(max) {}
-  void update(const size_t x) {
-    min = std::min(min, x);
-    max = std::max(max, x);
-  }
-  void reset(const size_t x) {
-    min = max = x;
-  }
-  size_t min;
-  size_t max;
-};
-
-class Bound {
- public:
-  size_t top, bottom, left, right;
-  Range top_r, bottom_r, left_r, right_r;
-  Bound(size_t width, size_t height)
-    : top(height-1), bottom(0), left(width-1), right(0),
-      top_r(width-1, 0), bottom_r(width-1, 0),
-      left_r(height-1, 0), right_r(height-1, 0) {}
-  void update(size_t x, size_t y) {
-    if (x > right) {
-      right = x;
-      right_r.reset(y);
-    } else if (x == right) {
-      right_r.update(y);
-    }
-    if (x < left) {
-      left= x;
-      left_r.reset(y);
-    } else if (x == left) {
-      left_r.update(y);
-    }
-    if (y > bottom) {
-      bottom = y;
-      bottom_r.reset(x);
-    } else if (y == bottom) {
-      bottom_r.update(x);
-    }
-    if (y < top) {
-      top = y;
-      top_r.reset(x);
-    } else if (y == top) {
-      top_r.update(x);
-    }
-  }
-};
-
 class ColorBlock {
  public:
   using index_t = std::tuple<int32_t, uint8_t, uint8_t, bool, bool>;
-  ColorBlock(const Color color, const size_t size)
+  ColorBlock(const Codel color, const size_t size)
     : color_(color), size_(size) {
     next_blocks.fill(std::make_tuple(-1, 0, 0, false, false));
   }
   void set_next_block(index_t index, uint8_t dp, uint8_t cc);
   index_t get_next_block(uint8_t dp, uint8_t cc) const;
-  Color get_color() const { return color_; }
+  Codel get_color() const { return color_; }
   size_t get_size() const { return size_; }
  private:
-  Color color_;
+  Codel color_;
   size_t size_;
   std::array<index_t, 8> next_blocks;
 };
 
-template <typename T>
-using cache_line_t = std::vector<std::array<std::array<T, 2>, 4>>;
-
-template <typename T>
-using cache_t = std::vector<cache_line_t<T>>;
-
-ColorBlock::index_t search(size_t width, size_t height, int64_t x, int64_t y, uint8_t dp, uint8_t cc, const FillMap &fm, cache_t<ColorBlock::index_t> &cache, cache_t<bool> &visit);
+// Result of search() for every (codel, dp, cc) state, shared by all threads.
+// An entry is a ColorBlock::index_t packed into 64 bits and accessed with
+// relaxed atomics; any thread storing a state stores the same value.
+// Codels are ordered like the codel table. A sparse cache keeps only the
+// states stored so far, in a hash map, and is for a single thread.
+class TransitionCache {
+ public:
+  TransitionCache(const size_t width, const size_t height, const GridLayout layout, const bool sparse = false)
+    : shape(width, height, 1, layout), entries(sparse ? 0 : shape.size() * 8), sparse(sparse), visited() {}
+  size_t state(const size_t x, const size_t y, const uint8_t dp, const uint8_t cc) const {
+    return (shape.offset(x, y) * 4 + dp) * 2 + cc;
+  }
+  // an entry whose valid flag is clear has not been computed yet
+  ColorBlock::index_t load(const size_t state) const {
+    if (sparse) {
+      const auto itr = visited.find(state);
+      return unpack(itr == visited.end() ? 0 : itr->second);
+    }
+    return unpack(entries[state].load(std::memory_order_relaxed));
+  }
+  void store(const size_t state, const ColorBlock::index_t &res) {
+    if (sparse) {
+      visited[state] = pack(res);
+      return;
+    }
+    entries[state].store(pack(res), std::memory_order_relaxed);
+  }
+ private:
+  static uint64_t pack(const ColorBlock::index_t &res) {
+    const auto [index, dp, cc, first, valid] = res;
+    return static_cast<uint32_t>(index) | uint64_t(dp) << 32 | uint64_t(cc) << 34
+      | uint64_t(first) << 35 | uint64_t(valid) << 36;
+  }
+  static ColorBlock::index_t unpack(const uint64_t e) {
+    return ColorBlock::index_t(static_cast<int32_t>(e), e >> 32 & 3, e >> 34 & 1, e >> 35 & 1, e >> 36 & 1);
+  }
+  GridShape shape;
+  std::vector<std::atomic<uint64_t>> entries;
+  bool sparse;
+  std::unordered_map<size_t, uint64_t> visited;
+};
 
-std::tuple<std::vector<Bound>, std::vector<int32_t>> get_bounds(
-    const FillMap &fill_map, const size_t width, const size_t height);
+// States on the path of the current search, for finding loops; one per
+// thread, sized by the longest path rather than the image
+class PathSet {
+ public:
+  PathSet() : slots(16, empty), used(), states_() {}
+  // false if the state was already there
+  bool insert(const size_t state);
+  void clear() {
+    for (const size_t slot : used) slots[slot] = empty;
+    used.clear();
+    states_.clear();
+  }
+  // in insertion order
+  const std::vector<size_t> &states() const { return states_; }
+ private:
+  static constexpr size_t empty = SIZE_MAX;
+  void grow();
+  std::vector<size_t> slots;  // open addressing, linear probing
+  std::vector<size_t> used;   // occupied slots
+  std::vector<size_t> states_;
+};
 
-template <typename T>
-cache_t<T> make_cache_buf(const size_t width, const size_t height, const T& elem) {
-  std::array<std::array<T, 2>, 4> ary = {{
-    {{elem, elem}},
-    {{elem, elem}},
-    {{elem, elem}},
-    {{elem, elem}}
-  }};
-  cache_t<T> cache(height);
-#pragma omp parallel for
-  for (size_t i = 0; i < height; ++i) {
-    cache[i].resize(width, ary);
+// Length of the white run starting at each codel in each direction, 0 on
+// codels that are not white, so search() crosses a white stretch in one step.
+// With on_demand nothing is stored and each run is measured on the codel
+// table when asked for, which costs as much as walking it.
+class SlideTable {
+ public:
+  explicit SlideTable(const CodelTable &table, const bool on_demand = false);
+  int32_t get(const size_t x, const size_t y, const uint8_t dp) const {
+    return on_demand ? measure(x, y, dp) : runs[dp][y][x];
   }
-  return cache;
-}
+  size_t width() const { return table.width(); }
+  size_t height() const { return table.height(); }
+ private:
+  int32_t measure(size_t x, size_t y, const uint8_t dp) const;
+  const CodelTable &table;
+  bool on_demand;
+  std::array<Grid<int32_t>, 4> runs;
+};
+
+ColorBlock::index_t search(size_t width, size_t height, int64_t x, int64_t y, uint8_t dp, uint8_t cc, FillMap &fm, const SlideTable &slides, TransitionCache &cache, PathSet &path);
 
+// With reachable_only, blocks are labeled and linked only as transitions
+// from block 0 reach them: a worklist takes the blocks in the order they are
+// found, and the searches from one block label the blocks they run into.
+// Blocks are numbered in that order, block 0 still being the first in
+// row-major order, and the rest of the image is never filled. White runs
+// are then measured as they are crossed and transitions cached sparsely,
+// so only the label grid still takes memory in proportion to the image.
 class ColorBlockGraph {
  public:
   template <typename CodelTable>
-  explicit ColorBlockGraph(const CodelTable &table) {
+  explicit ColorBlockGraph(const CodelTable &table, const bool reachable_only = false)
+    : blocks(), labeled(0) {
     const size_t height = table.height();
     const size_t width = table.width();
     FillMap fill_map(width, height, table);
+    const SlideTable slides(table, reachable_only);
+    TransitionCache cache(width, height, table.layout(), reachable_only);
+    if (reachable_only) {
+      for (size_t y = 0; y < height && fill_map.index_count() == 0; ++y) {
+        for (size_t x = 0; x < width; ++x) {
+          if (fill_map.is_color(x, y)) {
+            fill_map.fill(x, y);
+            break;
+          }
+        }
+      }
+      PathSet path;
+      for (size_t i = 0; i < fill_map.bounds().size(); ++i) {
+        // searches append to bounds
+        const Bound bound = fill_map.bounds()[i];
+        blocks.emplace_back(table[bound.top][bound.top_r.min], fill_map.block_sizes()[i]);
+        labeled += fill_map.block_sizes()[i];
+        link(i, bound, fill_map, slides, cache, path);
+      }
+      return;
+    }
     fill_map.fill_all();
-    auto [bounds, count] = get_bounds(fill_map, width, height);
+    const auto &bounds = fill_map.bounds();
+    const auto &count = fill_map.block_sizes();
     blocks.reserve(bounds.size());
     for (size_t i = 0; i < bounds.size(); ++i) {
       const auto &bound = bounds[i];
-      size_t x = bound.top_r.min;
-      size_t y = bound.top;
-      blocks.emplace_back(table[y][x], count[i]);
-    }
-    ColorBlock::index_t invalid(-1, 0, 0, false, false);
-    auto cache = make_cache_buf<ColorBlock::index_t>(width, height, invalid);
-    std::vector<cache_t<bool>> visits(omp_get_max_threads());
-#pragma omp parallel for
-    for (int i = 0; i < omp_get_max_threads(); ++i) {
-      visits[i] = cache_t<bool>(height, cache_line_t<bool>(width, {{}}));
+      blocks.emplace_back(table[bound.top][bound.top_r.min], count[i]);
+      labeled += count[i];
     }
+    std::vector<PathSet> paths(omp_get_max_threads());
 #pragma omp parallel for
     for (size_t i = 0; i < bounds.size(); ++i) {
-      cache_t<bool> &visit = visits[omp_get_thread_num()];
-      const auto &bound = bounds[i];
-      size_t x = bound.top_r.min;
-      size_t y = bound.top;
-      auto next = search(width, height, x, y, 3, 0, fill_map, cache, visit);
-      blocks[i].set_next_block(next, 3, 0);
-      x = bound.top_r.max;
-      next = search(width, height, x, y, 3, 1, fill_map, cache, visit);
-      blocks[i].set_next_block(next, 3, 1);
-      x = bound.right;
-      y = bound.right_r.min;
-      next = search(width, height, x, y, 0, 0, fill_map, cache, visit);
-      blocks[i].set_next_block(next, 0, 0);
-      y = bound.right_r.max;
-      next = search(width, height, x, y, 0, 1, fill_map, cache, visit);
-      blocks[i].set_next_block(next, 0, 1);
-      x = bound.bottom_r.max;
-      y = bound.bottom;
-      next = search(width, height, x, y, 1, 0, fill_map, cache, visit);
-      blocks[i].set_next_block(next, 1, 0);
-      x = bound.bottom_r.min;
-      next = search(width, height, x, y, 1, 1, fill_map, cache, visit);
-      blocks[i].set_next_block(next, 1, 1);
-      x = bound.left;
-      y = bound.left_r.max;
-      next = search(width, height, x, y, 2, 0, fill_map, cache, visit);
-      blocks[i].set_next_block(next, 2, 0);
-      y = bound.left_r.min;
-      next = search(width, height, x, y, 2, 1, fill_map, cache, visit);
-      blocks[i].set_next_block(next, 2, 1);
+      link(i, bounds[i], fill_map, slides, cache, paths[omp_get_thread_num()]);
     }
   }
   size_t size() const { return blocks.size(); }
   ColorBlock &operator[](const size_t index) { return blocks[index]; }
   const ColorBlock &operator[](const size_t index) const { return blocks[index]; }
+  // codels in all blocks
+  size_t labeled_count() const { return labeled; }
  private:
+  // searches the eight exits of a block
+  void link(const size_t index, const Bound &bound, FillMap &fill_map,
+      const SlideTable &slides, TransitionCache &cache, PathSet &path);
   std::vector<ColorBlock> blocks;
+  size_t labeled;
 };
@@ -1,39 +1,202 @@
 #include "fillmap.hpp"
-#include <queue>
-#include <tuple>
+#include <algorithm>
+#include <omp.h>
 
+namespace {
+
+using index_t = FillMap::index_t;
+
+// Horizontal run of codels of one colour in a row, columns [begin, end)
+struct Run {
+  index_t row;
+  index_t begin;
+  index_t end;
+};
+
+// parent[p] <= p always holds, so the root of a set is its first run
+index_t find(std::vector<index_t> &parent, index_t p) {
+  index_t root = p;
+  while (parent[root] != root) root = parent[root];
+  while (parent[p] != root) {
+    const index_t next = parent[p];
+    parent[p] = root;
+    p = next;
+  }
+  return root;
+}
+
+void unite(std::vector<index_t> &parent, const index_t a, const index_t b) {
+  const index_t ra = find(parent, a), rb = find(parent, b);
+  if (ra < rb) {
+    parent[rb] = ra;
+  } else if (rb < ra) {
+    parent[ra] = rb;
+  }
+}
+
+// unites the runs of two consecutive rows that touch and share a colour;
+// runs[r - offset] is the run with id r
+void join_rows(const CodelTable &table, std::vector<index_t> &parent,
+    const Run *above_runs, const index_t above_offset, index_t above, const index_t above_end,
+    const Run *below_runs, const index_t below_offset, const index_t below, const index_t below_end) {
+  if (above == above_end) return;
+  const auto above_row = table[above_runs[above - above_offset].row];
+  for (index_t r = below; r < below_end; ++r) {
+    const Run &run = below_runs[r - below_offset];
+    while (above < above_end && above_runs[above - above_offset].end <= run.begin) ++above;
+    const Codel color = table[run.row][run.begin];
+    for (index_t q = above; q < above_end && above_runs[q - above_offset].begin < run.end; ++q) {
+      if (above_row[above_runs[q - above_offset].begin] == color) unite(parent, r, q);
+    }
+  }
+}
+
+} // namespace
+
+// Union-find over the colour runs of each row, with the table cut into
+// horizontal stripes: each stripe is labeled on its own, the stripes are
+// joined along their borders, and the roots, being the first runs of their
+// blocks, are numbered in order. Sizes and bounds are then taken from the
+// run endpoints, so a block costs one update per run instead of per codel.
 FillMap::index_t FillMap::fill_all() {
-  for (size_t i = 0; i < height_; ++i) {
-    for (size_t j = 0; j < width_; ++j) {
-      if (!visited_table[i][j] && ::is_color(ref_table_[i][j])) {
-        filled_size.push_back(fill(j, i));
+  const index_t width = width_, height = height_;
+  const index_t stripes = std::max<index_t>(1, std::min<index_t>(height, omp_get_max_threads() * 4));
+  std::vector<index_t> begin(stripes + 1);
+  for (index_t s = 0; s <= stripes; ++s) begin[s] = static_cast<int64_t>(height) * s / stripes;
+
+  // first run of each row, local to its stripe until the stripes are joined
+  std::vector<index_t> row_first(height + 1);
+  std::vector<std::vector<Run>> stripe_runs(stripes);
+  std::vector<std::vector<index_t>> stripe_parent(stripes);
+#pragma omp parallel for schedule(dynamic)
+  for (index_t s = 0; s < stripes; ++s) {
+    auto &runs = stripe_runs[s];
+    auto &parent = stripe_parent[s];
+    for (index_t i = begin[s]; i < begin[s+1]; ++i) {
+      const auto row = ref_table_[i];
+      row_first[i] = runs.size();
+      for (index_t j = 0; j < width;) {
+        if (!::is_color(row[j])) {
+          ++j;
+          continue;
+        }
+        const index_t start = j;
+        while (j < width && row[j] == row[start]) ++j;
+        parent.push_back(runs.size());
+        runs.push_back(Run { i, start, j });
+      }
+      if (i > begin[s]) {
+        join_rows(ref_table_, parent, runs.data(), 0, row_first[i-1], row_first[i],
+            runs.data(), 0, row_first[i], runs.size());
       }
     }
   }
+
+  std::vector<index_t> run_begin(stripes + 1, 0);
+  for (index_t s = 0; s < stripes; ++s) run_begin[s+1] = run_begin[s] + stripe_runs[s].size();
+  // run ids become global; the runs stay with their stripe
+  std::vector<index_t> parent(run_begin[stripes]);
+#pragma omp parallel for schedule(dynamic)
+  for (index_t s = 0; s < stripes; ++s) {
+    const index_t offset = run_begin[s];
+    for (size_t r = 0; r < stripe_parent[s].size(); ++r) parent[offset + r] = stripe_parent[s][r] + offset;
+    for (index_t i = begin[s]; i < begin[s+1]; ++i) row_first[i] += offset;
+    std::vector<index_t>().swap(stripe_parent[s]);
+  }
+  row_first[height] = run_begin[stripes];
+  for (index_t s = 1; s < stripes; ++s) {
+    const index_t i = begin[s];
+    join_rows(ref_table_, parent, stripe_runs[s-1].data(), run_begin[s-1], row_first[i-1], row_first[i],
+        stripe_runs[s].data(), run_begin[s], row_first[i], row_first[i+1]);
+  }
+
+  std::vector<index_t> roots(stripes + 1, 0);
+#pragma omp parallel for schedule(dynamic)
+  for (index_t s = 0; s < stripes; ++s) {
+    for (index_t r = run_begin[s]; r < run_begin[s+1]; ++r) {
+      if (parent[r] == r) ++roots[s+1];
+    }
+  }
+  for (index_t s = 0; s < stripes; ++s) roots[s+1] += roots[s];
+  index = roots[stripes];
+
+  std::vector<index_t> labels(run_begin[stripes]);
+#pragma omp parallel for schedule(dynamic)
+  for (index_t s = 0; s < stripes; ++s) {
+    index_t next = roots[s];
+    for (index_t r = run_begin[s]; r < run_begin[s+1]; ++r) {
+      if (parent[r] == r) labels[r] = next++;
+    }
+  }
+
+  // A run's parent is either earlier in its own stripe, and so already
+  // labeled, or in an earlier stripe, whose roots are labeled. Blocks are
+  // measured by the stripe that numbered them; runs of blocks from earlier
+  // stripes are left for a serial pass.
+  bounds_.assign(index, Bound(width_, height_));
+  sizes_.assign(index, 0);
+  std::vector<std::vector<index_t>> deferred(stripes);
+#pragma omp parallel for schedule(dynamic)
+  for (index_t s = 0; s < stripes; ++s) {
+    for (index_t r = run_begin[s]; r < run_begin[s+1]; ++r) {
+      if (parent[r] != r) {
+        index_t q = parent[r];
+        if (q < run_begin[s]) {
+          while (parent[q] != q) q = parent[q];
+        }
+        labels[r] = labels[q];
+      }
+      const Run &run = stripe_runs[s][r - run_begin[s]];
+      const index_t label = labels[r];
+      index_table.fill_row(run.row, run.begin, run.end, label);
+      if (label < roots[s]) {
+        deferred[s].push_back(r);
+        continue;
+      }
+      bounds_[label].update(run.begin, run.end - 1, run.row);
+      sizes_[label] += run.end - run.begin;
+    }
+  }
+  for (index_t s = 0; s < stripes; ++s) {
+    for (const index_t r : deferred[s]) {
+      const Run &run = stripe_runs[s][r - run_begin[s]];
+      bounds_[labels[r]].update(run.begin, run.end - 1, run.row);
+      sizes_[labels[r]] += run.end - run.begin;
+    }
+  }
   return index;
 }
 
-size_t FillMap::fill_impl(const int x, const int y) {
-  size_t count = 0;
-  visited_table[y][x] = true;
-  std::queue<std::tuple<int64_t, int64_t>> q;
-  q.emplace(x, y);
-  while (!q.empty()) {
-    auto [qx, qy] = q.front();
-    q.pop();
-    index_table[qy][qx] = index;
-    ++count;
-    const int dx[] = {0, -1, 0, 1};
-    const int dy[] = {1, 0, -1, 0};
-    for (int i = 0; i < 4; ++i) {
-      const int64_t nx = qx + dx[i];
-      const int64_t ny = qy + dy[i];
-      if (nx < 0 || nx >= (int64_t)width_ || ny < 0 || ny >= (int64_t)height_) continue;
-      if (visited_table[ny][nx]) continue;
-      if (ref_table_[qy][qx] != ref_table_[ny][nx]) continue;
-      visited_table[ny][nx] = true;
-      q.emplace(nx, ny);
+// Scanline fill: each run of the block is labeled as a whole, and one seed
+// is left for every run of the block's colour touching it from above or below.
+FillMap::index_t FillMap::fill(const size_t x, const size_t y) {
+  const Codel color = ref_table_[y][x];
+  const index_t label = index++;
+  Bound bound(width_, height_);
+  int32_t size = 0;
+  std::vector<std::pair<size_t, size_t>> seeds(1, std::make_pair(x, y));
+  while (!seeds.empty()) {
+    const auto [sx, sy] = seeds.back();
+    seeds.pop_back();
+    if (index_table[sy][sx] >= 0) continue;
+    const auto row = ref_table_[sy];
+    size_t x0 = sx, x1 = sx + 1;
+    while (x0 > 0 && row[x0-1] == color) --x0;
+    while (x1 < width_ && row[x1] == color) ++x1;
+    index_table.fill_row(sy, x0, x1, label);
+    bound.update(x0, x1 - 1, sy);
+    size += x1 - x0;
+    for (const size_t ny : { sy - 1, sy + 1 }) {
+      if (ny >= height_) continue;
+      const auto next_row = ref_table_[ny];
+      for (size_t i = x0; i < x1; ++i) {
+        if (next_row[i] == color && (i == x0 || next_row[i-1] != color) && index_table[ny][i] < 0) {
+          seeds.emplace_back(i, ny);
+        }
+      }
     }
   }
-  return count;
+  bounds_.push_back(bound);
+  sizes_.push_back(size);
+  return label;
 }
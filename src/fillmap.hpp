@@ -3,24 +3,116 @@
 #include "codel.hpp"
 #include "utils.hpp"
 
+class Range {
+ public:
+  Range(const size_t min, const size_t max)
+    : min(min), max(max) {}
+  void update(const size_t x) {
+    min = std::min(min, x);
+    max = std::max(max, x);
+  }
+  void reset(const size_t x) {
+    min = max = x;
+  }
+  void reset(const size_t lo, const size_t hi) {
+    min = lo;
+    max = hi;
+  }
+  size_t min;
+  size_t max;
+};
+
+class Bound {
+ public:
+  size_t top, bottom, left, right;
+  Range top_r, bottom_r, left_r, right_r;
+  Bound(size_t width, size_t height)
+    : top(height-1), bottom(0), left(width-1), right(0),
+      top_r(width-1, 0), bottom_r(width-1, 0),
+      left_r(height-1, 0), right_r(height-1, 0) {}
+  void update(size_t x, size_t y) {
+    if (x > right) {
+      right = x;
+      right_r.reset(y);
+    } else if (x == right) {
+      right_r.update(y);
+    }
+    if (x < left) {
+      left= x;
+      left_r.reset(y);
+    } else if (x == left) {
+      left_r.update(y);
+    }
+    if (y > bottom) {
+      bottom = y;
+      bottom_r.reset(x);
+    } else if (y == bottom) {
+      bottom_r.update(x);
+    }
+    if (y < top) {
+      top = y;
+      top_r.reset(x);
+    } else if (y == top) {
+      top_r.update(x);
+    }
+  }
+  // same as update(x, y) for every x in [x0, x1]
+  void update(size_t x0, size_t x1, size_t y) {
+    if (x1 > right) {
+      right = x1;
+      right_r.reset(y);
+    } else if (x1 == right) {
+      right_r.update(y);
+    }
+    if (x0 < left) {
+      left = x0;
+      left_r.reset(y);
+    } else if (x0 == left) {
+      left_r.update(y);
+    }
+    if (y > bottom) {
+      bottom = y;
+      bottom_r.reset(x0, x1);
+    } else if (y == bottom) {
+      bottom_r.update(x0);
+      bottom_r.update(x1);
+    }
+    if (y < top) {
+      top = y;
+      top_r.reset(x0, x1);
+    } else if (y == top) {
+      top_r.update(x0);
+      top_r.update(x1);
+    }
+  }
+};
+
+// Labels the colour blocks of a codel table. Blocks are numbered in the
+// order their first codel appears in row-major order, so the block holding
+// the top-left codel is 0; black and white codels are labeled -1.
+// Each block's codel count and Bound come out of the same pass.
+// Alternatively fill labels single blocks as they are needed, numbered in
+// the order they are filled, and leaves the rest of the table at -1.
 class FillMap {
  public:
   using index_t = int32_t;
   FillMap(const size_t width, const size_t height, const CodelTable& ref_table)
     : width_(width), height_(height), index(0),
-      index_table(height, std::vector<index_t>(width, -1)),
-      visited_table(height, std::vector<bool>(width, false)),
-      filled_size(),
+      index_table(width, height, -1, ref_table.layout()),
+      bounds_(), sizes_(),
       ref_table_(ref_table){}
   index_t fill_all();
-  size_t fill(const size_t x, const size_t y) {
-    size_t res = fill_impl(x, y);
-    ++index;
-    return res;
-  }
+  // labels the block holding the colour codel (x, y)
+  index_t fill(const size_t x, const size_t y);
   index_t get_index(const size_t x, const size_t y) const {
     return index_table[y][x];
   }
+  // the index of the colour codel (x, y), filling its block first if it has
+  // not been; after fill_all this only reads
+  index_t label(const size_t x, const size_t y) {
+    const index_t res = index_table[y][x];
+    return res >= 0 ? res : fill(x, y);
+  }
   bool is_black(const size_t x, const size_t y) const {
     return ::is_black(ref_table_[y][x]);
   }
@@ -31,13 +123,14 @@ class FillMap {
     return ::is_color(ref_table_[y][x]);
   }
   index_t index_count() const { return index; }
+  const std::vector<Bound> &bounds() const { return bounds_; }
+  const std::vector<int32_t> &block_sizes() const { return sizes_; }
  private:
-  size_t fill_impl(const int x, const int y);
   const size_t width_;
   const size_t height_;
   index_t index;
-  std::vector<std::vector<index_t>> index_table;
-  std::vector<std::vector<bool>> visited_table;
-  std::vector<size_t> filled_size;
+  Grid<index_t> index_table;
+  std::vector<Bound> bounds_;
+  std::vector<int32_t> sizes_;
   const CodelTable & ref_table_;
 };
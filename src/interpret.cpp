@@ -1,20 +1,32 @@
 #include "interpret.hpp"
 #include <stdexcept>
-#include <map>
+#include <algorithm>
+#include <array>
 #include <iostream>
+#include <map>
 #include "io32.hpp"
 #include "parser.hpp"
 
+// Rotates in place: the shorter side of the window goes through a small
+// buffer on the machine stack and the rest is moved with a single memmove.
 void Stack::roll(const int32_t depth, const int32_t iter) {
-  std::vector<int32_t> buf(depth);
-  for (int i = 0; i < iter; ++i) {
-    buf[i] = data[data.size() - iter + i];
-  }
-  for (int i = 0; i < depth - iter; ++i) {
-    buf[i+iter] = data[data.size() - depth + i];
-  }
-  for (int i = 0; i < depth; ++i) {
-    data[data.size() - depth + i] = buf[i];
+  constexpr int32_t buffer_size = 64;
+  int32_t * const last = data.data() + data.size();
+  int32_t * const first = last - depth;
+  const int32_t rest = depth - iter;
+  if (iter == 0) return;
+  if (iter <= buffer_size) {
+    int32_t buf[buffer_size];
+    std::copy(last - iter, last, buf);
+    std::copy_backward(first, last - iter, last);
+    std::copy(buf, buf + iter, first);
+  } else if (rest <= buffer_size) {
+    int32_t buf[buffer_size];
+    std::copy(first, first + rest, buf);
+    std::copy(first + rest, last, first);
+    std::copy(buf, buf + rest, last - rest);
+  } else {
+    std::rotate(first, last - iter, last);
   }
 }
 
@@ -24,104 +36,142 @@ int32_t mod(int32_t x, int32_t d) {
   return y;
 }
 
-std::shared_ptr<Command> Switch::exec(Stack & stack) const {
+int32_t Switch::exec(Stack & stack) const {
   //std::cerr << "Switch" << std::endl;
   if (!stack.empty()) {
     int32_t value;
     value = stack.top();
     stack.pop();
     int32_t m = mod(value, 2);
-    return nexts[m].lock();
+    return m;
   } else {
-    return nexts[0].lock();
+    return 0;
   }
 }
 
-std::shared_ptr<Command> Pointer::exec(Stack & stack) const {
+int32_t Switch::exec_unchecked(Stack & stack) const {
+  int32_t value = stack.top();
+  stack.pop();
+  return mod(value, 2);
+}
+
+int32_t Pointer::exec(Stack & stack) const {
   //std::cerr << "Pointer" << std::endl;
   if (!stack.empty()) {
     int32_t value;
     value = stack.top();
     stack.pop();
     int32_t m = mod(value, 4);
-    return nexts[m].lock();
+    return m;
   } else {
-    return nexts[0].lock();
+    return 0;
   }
 }
 
-std::shared_ptr<Command> Jez::exec(Stack & stack) const {
+int32_t Pointer::exec_unchecked(Stack & stack) const {
+  int32_t value = stack.top();
+  stack.pop();
+  return mod(value, 4);
+}
+
+int32_t Jez::exec(Stack & stack) const {
   //std::cerr << "Jez" << std::endl;
   if (!stack.empty()) {
     int32_t value;
     value = stack.top();
     stack.pop();
     if (value == 0) {
-      return nexts[1].lock();
+      return 1;
     } else {
-      return nexts[0].lock();
+      return 0;
     }
   } else {
-    return nexts[0].lock();
+    return 0;
   }
 }
 
-std::shared_ptr<Command> Push::exec(Stack & stack) const {
+int32_t Jez::exec_unchecked(Stack & stack) const {
+  int32_t value = stack.top();
+  stack.pop();
+  return value == 0 ? 1 : 0;
+}
+
+int32_t Push::exec(Stack & stack) const {
   //std::cerr << "Push" << std::endl;
   stack.push(value);
-  return next.lock();
+  return 0;
 }
 
-std::shared_ptr<Command> PushArray::exec(Stack & stack) const {
+int32_t PushArray::exec(Stack & stack) const {
   stack.push_array(data);
-  return next.lock();
+  return 0;
 }
 
-std::shared_ptr<Command> Duplicate::exec(Stack & stack) const {
+int32_t Duplicate::exec(Stack & stack) const {
   //std::cerr << "Duplicate" << std::endl;
   if (!stack.empty()) stack.push(stack.top());
-  return next.lock();
+  return 0;
 }
 
-std::shared_ptr<Command> InNumber::exec(Stack & stack) const {
+int32_t Duplicate::exec_unchecked(Stack & stack) const {
+  stack.push(stack.top());
+  return 0;
+}
+
+int32_t InNumber::exec(Stack & stack) const {
   //std::cerr << "InNumber" << std::endl;
-  int32_t value;
-  std::cin >> value;
-  stack.push(value);
-  return next.lock();
+  stack.push(io32::getnumber());
+  return 0;
 }
 
-std::shared_ptr<Command> InChar::exec(Stack & stack) const {
+int32_t InChar::exec(Stack & stack) const {
   //std::cerr << "InChar" << std::endl;
   stack.push(io32::getchar());
-  return next.lock();
+  return 0;
 }
 
-std::shared_ptr<Command> Pop::exec(Stack & stack) const {
+int32_t Pop::exec(Stack & stack) const {
   //std::cerr << "Pop" << std::endl;
-  if (!stack.empty()) stack.pop();
-  return next.lock();
+  for (int32_t i = 0; i < count && !stack.empty(); ++i) stack.pop();
+  return 0;
+}
+
+int32_t Pop::exec_unchecked(Stack & stack) const {
+  stack.drop(count);
+  return 0;
 }
 
-std::shared_ptr<Command> OutNumber::exec(Stack & stack) const {
+int32_t OutNumber::exec(Stack & stack) const {
   //std::cerr << "OutNumber" << std::endl;
   if (!stack.empty()) {
-    std::cout << stack.top();
+    io32::putnumber(stack.top());
     stack.pop();
   }
-  return next.lock();
+  return 0;
+}
+
+int32_t OutNumber::exec_unchecked(Stack & stack) const {
+  io32::putnumber(stack.top());
+  stack.pop();
+  return 0;
 }
 
-std::shared_ptr<Command> OutChar::exec(Stack & stack) const {
+int32_t OutChar::exec(Stack & stack) const {
   //std::cerr << "OutChar" << std::endl;
   if (!stack.empty()) {
     io32::putchar(stack.top());
     stack.pop();
   }
-  return next.lock();
+  return 0;
 }
 
-std::shared_ptr<Command> BinaryOp::exec(Stack & stack) const noexcept {
+int32_t OutChar::exec_unchecked(Stack & stack) const {
+  io32::putchar(stack.top());
+  stack.pop();
+  return 0;
+}
+
+int32_t BinaryOp::exec(Stack & stack) const noexcept {
   if (stack.size() >= 2) {
     int arg2 = stack.top(); stack.pop();
     int arg1 = stack.top(); stack.pop();
@@ -133,7 +183,19 @@ std::shared_ptr<Command> BinaryOp::exec(Stack & stack) const noexcept {
       stack.push(arg2);
     }
   } 
-  return next.lock();
+  return 0;
+}
+
+int32_t BinaryOp::exec_unchecked(Stack & stack) const noexcept {
+  int arg2 = stack.top(); stack.pop();
+  int arg1 = stack.top(); stack.pop();
+  try {
+    stack.push(bin_op(arg1, arg2));
+  } catch (...) {
+    stack.push(arg1);
+    stack.push(arg2);
+  }
+  return 0;
 }
 
 int Add::bin_op(int lhs, int rhs) const noexcept {
@@ -153,11 +215,13 @@ int Multiply::bin_op(int lhs, int rhs) const noexcept {
 
 int Divide::bin_op(int lhs, int rhs) const {
   //std::cerr << "Divide" << std::endl;
+  if (rhs == 0) throw std::domain_error("divide by zero");
   return lhs / rhs;
 }
 
 int Modulo::bin_op(int lhs, int rhs) const {
   //std::cerr << "Modulo" << std::endl;
+  if (rhs == 0) throw std::domain_error("divide by zero");
   return lhs % rhs;
 }
 
@@ -166,16 +230,22 @@ int Greater::bin_op(int lhs, int rhs) const noexcept {
   return lhs > rhs ? 1 : 0;
 }
 
-std::shared_ptr<Command> Not::exec(Stack & stack) const {
+int32_t Not::exec(Stack & stack) const {
   //std::cerr << "Not" << std::endl;
   if (!stack.empty()) {
     int32_t top = stack.top(); stack.pop();
     stack.push(top ? 0 : 1);
   }
-  return next.lock();
+  return 0;
+}
+
+int32_t Not::exec_unchecked(Stack & stack) const {
+  int32_t top = stack.top(); stack.pop();
+  stack.push(top ? 0 : 1);
+  return 0;
 }
 
-std::shared_ptr<Command> Swap::exec(Stack & stack) const {
+int32_t Swap::exec(Stack & stack) const {
   //std::cerr << "Swap" << std::endl;
   if (stack.size() >= 2) {
     int arg2 = stack.top(); stack.pop();
@@ -183,10 +253,18 @@ std::shared_ptr<Command> Swap::exec(Stack & stack) const {
     stack.push(arg2);
     stack.push(arg1);
   } 
-  return next.lock();
+  return 0;
+}
+
+int32_t Swap::exec_unchecked(Stack & stack) const {
+  int arg2 = stack.top(); stack.pop();
+  int arg1 = stack.top(); stack.pop();
+  stack.push(arg2);
+  stack.push(arg1);
+  return 0;
 }
 
-std::shared_ptr<Command> Roll::exec(Stack & stack) const {
+int32_t Roll::exec(Stack & stack) const {
   //std::cerr << "Roll" << std::endl;
   if (stack.size() >= 2) {
     int iter = stack.top(); stack.pop();
@@ -200,97 +278,192 @@ std::shared_ptr<Command> Roll::exec(Stack & stack) const {
       stack.push(iter);
     }
   } 
-  return next.lock();
+  return 0;
 }
 
-CommandGraph::CommandGraph(const ColorBlockGraph &graph) : nodes() {
-  size_t size = graph.size();
-  for (size_t i = 0; i < size; ++i) {
-    for (size_t j = 0; j < 4; ++j) {
-      for (size_t k = 0; k < 2; ++k) {
-        int32_t index;
-        size_t dp, cc;
-        bool conn;
-        int old_dp = j, old_cc = k;
-        for (size_t l = 0; l < 4; ++l) {
-          std::tie(index, dp, cc, conn, std::ignore) = graph[i].get_next_block(old_dp, old_cc);
-          if (index >= 0 || conn) break;
-          old_cc = 1-old_cc;
-          std::tie(index, dp, cc, conn, std::ignore) = graph[i].get_next_block(old_dp, old_cc);
-          if (index >= 0 || conn) break;
-          old_dp += 1;
-          old_dp %= 4;
-        }
-        if (index >= 0 && conn) {
-          switch (color_to_command(graph[i].get_color(), graph[index].get_color())) {
-            case CommandType::NOP:
-              nodes.push_back(std::make_shared<Nop>());
-              break;
-            case CommandType::PUSH:
-              nodes.push_back(std::make_shared<Push>(graph[i].get_size()));
-              break;
-            case CommandType::POP:
-              nodes.push_back(std::make_shared<Pop>());
-              break;
-            case CommandType::ADD:
-              nodes.push_back(std::make_shared<Add>());
-              break;
-            case CommandType::SUBTRACT:
-              nodes.push_back(std::make_shared<Subtract>());
-              break;
-            case CommandType::MULTIPLY:
-              nodes.push_back(std::make_shared<Multiply>());
-              break;
-            case CommandType::DIVIDE:
-              nodes.push_back(std::make_shared<Divide>());
-              break;
-            case CommandType::MOD:
-              nodes.push_back(std::make_shared<Modulo>());
-              break;
-            case CommandType::NOT:
-              nodes.push_back(std::make_shared<Not>());
-              break;
-            case CommandType::GREATER:
-              nodes.push_back(std::make_shared<Greater>());
-              break;
-            case CommandType::POINTER:
-              nodes.push_back(std::make_shared<Pointer>());
-              break;
-            case CommandType::SWITCH:
-              nodes.push_back(std::make_shared<Switch>());
-              break;
-            case CommandType::DUPLICATE:
-              nodes.push_back(std::make_shared<Duplicate>());
-              break;
-            case CommandType::ROLL:
-              nodes.push_back(std::make_shared<Roll>());
-              break;
-            case CommandType::INN:
-              nodes.push_back(std::make_shared<InNumber>());
-              break;
-            case CommandType::INC:
-              nodes.push_back(std::make_shared<InChar>());
-              break;
-            case CommandType::OUTN:
-              nodes.push_back(std::make_shared<OutNumber>());
-              break;
-            case CommandType::OUTC:
-              nodes.push_back(std::make_shared<OutChar>());
-              break;
-            case CommandType::HALT:
-              nodes.push_back(std::make_shared<Halt>());
-              break;
-            default: throw std::domain_error("Unknown CommandType");
-          }
-        } else if (index >= 0) {
-          nodes.push_back(std::make_shared<Nop>());
-        } else {
-          nodes.push_back(std::make_shared<Halt>());
-        }
-      }
+int32_t Roll::exec_unchecked(Stack & stack) const {
+  int iter = stack.top(); stack.pop();
+  int depth = stack.top(); stack.pop();
+  if (depth >= 0 && stack.size() >= (size_t)depth) {
+    if (depth > 0) {
+      stack.roll(depth, mod(iter, depth));
     }
+  } else {
+    stack.push(depth);
+    stack.push(iter);
   }
-  for (size_t i = 0; i < size; ++i) {
+  return 0;
+}
+
+int32_t AddImm::exec(Stack & stack) const {
+  if (!stack.empty()) {
+    int32_t top = stack.top(); stack.pop();
+    stack.push(top + value);
+  } else {
+    stack.push(value);
+  }
+  return 0;
+}
+
+int32_t AddImm::exec_unchecked(Stack & stack) const {
+  int32_t top = stack.top(); stack.pop();
+  stack.push(top + value);
+  return 0;
+}
+
+int32_t SubImm::exec(Stack & stack) const {
+  if (!stack.empty()) {
+    int32_t top = stack.top(); stack.pop();
+    stack.push(top - value);
+  } else {
+    stack.push(value);
+  }
+  return 0;
+}
+
+int32_t SubImm::exec_unchecked(Stack & stack) const {
+  int32_t top = stack.top(); stack.pop();
+  stack.push(top - value);
+  return 0;
+}
+
+int32_t MulImm::exec(Stack & stack) const {
+  if (!stack.empty()) {
+    int32_t top = stack.top(); stack.pop();
+    stack.push(top * value);
+  } else {
+    stack.push(value);
+  }
+  return 0;
+}
+
+int32_t MulImm::exec_unchecked(Stack & stack) const {
+  int32_t top = stack.top(); stack.pop();
+  stack.push(top * value);
+  return 0;
+}
+
+int32_t NotNot::exec(Stack & stack) const {
+  if (!stack.empty()) {
+    int32_t top = stack.top(); stack.pop();
+    stack.push(top ? 1 : 0);
+  }
+  return 0;
+}
+
+int32_t NotNot::exec_unchecked(Stack & stack) const {
+  int32_t top = stack.top(); stack.pop();
+  stack.push(top ? 1 : 0);
+  return 0;
+}
+
+int32_t RollConst::exec(Stack & stack) const {
+  if (depth >= 0 && stack.size() >= (size_t)depth) {
+    if (depth > 0) {
+      stack.roll(depth, mod(iter, depth));
+    }
+  } else {
+    stack.push(depth);
+    stack.push(iter);
+  }
+  return 0;
+}
+
+int32_t RollConst::exec_unchecked(Stack & stack) const {
+  if (depth > 0) {
+    stack.roll(depth, mod(iter, depth));
+  }
+  return 0;
+}
+
+int32_t DupBranchZero::exec(Stack & stack) const {
+  if (!stack.empty() && stack.top() == 0) {
+    return 1;
+  } else {
+    return 0;
+  }
+}
+
+int32_t DupBranchZero::exec_unchecked(Stack & stack) const {
+  return stack.top() == 0 ? 1 : 0;
+}
+
+std::string command_name(const ConcreteCommandType type) {
+  switch (type) {
+    case ConcreteCommandType::Switch: return "Switch";
+    case ConcreteCommandType::Pointer: return "Pointer";
+    case ConcreteCommandType::Jez: return "Jez";
+    case ConcreteCommandType::Halt: return "Halt";
+    case ConcreteCommandType::Nop: return "Nop";
+    case ConcreteCommandType::Push: return "Push";
+    case ConcreteCommandType::PushArray: return "PushArray";
+    case ConcreteCommandType::Duplicate: return "Duplicate";
+    case ConcreteCommandType::InNumber: return "InNumber";
+    case ConcreteCommandType::InChar: return "InChar";
+    case ConcreteCommandType::Pop: return "Pop";
+    case ConcreteCommandType::OutNumber: return "OutNumber";
+    case ConcreteCommandType::OutChar: return "OutChar";
+    case ConcreteCommandType::Add: return "Add";
+    case ConcreteCommandType::Subtract: return "Subtract";
+    case ConcreteCommandType::Multiply: return "Multiply";
+    case ConcreteCommandType::Divide: return "Divide";
+    case ConcreteCommandType::Modulo: return "Modulo";
+    case ConcreteCommandType::Greater: return "Greater";
+    case ConcreteCommandType::Not: return "Not";
+    case ConcreteCommandType::Swap: return "Swap";
+    case ConcreteCommandType::Roll: return "Roll";
+    case ConcreteCommandType::AddImm: return "AddImm";
+    case ConcreteCommandType::SubImm: return "SubImm";
+    case ConcreteCommandType::MulImm: return "MulImm";
+    case ConcreteCommandType::NotNot: return "NotNot";
+    case ConcreteCommandType::RollConst: return "RollConst";
+    case ConcreteCommandType::DupBranchZero: return "DupBranchZero";
+    default: throw std::domain_error("Unknown ConcreteCommandType");
+  }
+}
+
+namespace {
+
+ConcreteCommandType concrete_type(const CommandType type) {
+  switch (type) {
+    case CommandType::NOP: return ConcreteCommandType::Nop;
+    case CommandType::PUSH: return ConcreteCommandType::Push;
+    case CommandType::POP: return ConcreteCommandType::Pop;
+    case CommandType::ADD: return ConcreteCommandType::Add;
+    case CommandType::SUBTRACT: return ConcreteCommandType::Subtract;
+    case CommandType::MULTIPLY: return ConcreteCommandType::Multiply;
+    case CommandType::DIVIDE: return ConcreteCommandType::Divide;
+    case CommandType::MOD: return ConcreteCommandType::Modulo;
+    case CommandType::NOT: return ConcreteCommandType::Not;
+    case CommandType::GREATER: return ConcreteCommandType::Greater;
+    case CommandType::POINTER: return ConcreteCommandType::Pointer;
+    case CommandType::SWITCH: return ConcreteCommandType::Switch;
+    case CommandType::DUPLICATE: return ConcreteCommandType::Duplicate;
+    case CommandType::ROLL: return ConcreteCommandType::Roll;
+    case CommandType::INN: return ConcreteCommandType::InNumber;
+    case CommandType::INC: return ConcreteCommandType::InChar;
+    case CommandType::OUTN: return ConcreteCommandType::OutNumber;
+    case CommandType::OUTC: return ConcreteCommandType::OutChar;
+    case CommandType::HALT: return ConcreteCommandType::Halt;
+    default: throw std::domain_error("Unknown CommandType");
+  }
+}
+
+} // namespace
+
+void CommandGraph::resize(const size_t size) {
+  ops.assign(size, ConcreteCommandType::Halt);
+  immediates.assign(size, 0);
+  successors.assign(size * max_nexts, -1);
+}
+
+// Every node depends only on its own block, so the blocks are filled in
+// parallel, each walking the DP/CC retries once per state.
+CommandGraph::CommandGraph(const ColorBlockGraph &graph) {
+  const int64_t size = graph.size();
+  resize(size * 8);
+#pragma omp parallel for schedule(dynamic, 1024)
+  for (int64_t i = 0; i < size; ++i) {
     for (size_t j = 0; j < 4; ++j) {
       for (size_t k = 0; k < 2; ++k) {
         int32_t nindex;
@@ -306,147 +479,374 @@ CommandGraph::CommandGraph(const ColorBlockGraph &graph) : nodes() {
           old_dp += 1;
           old_dp %= 4;
         }
-        int index = i*8 + j*2 + k;
-        int next_index = nindex*8 + dp*2 + cc;
-        if (nindex >= 0 && conn) {
-          switch (color_to_command(graph[i].get_color(), graph[nindex].get_color())) {
-            case CommandType::NOP:
-            case CommandType::PUSH:
-            case CommandType::POP:
-            case CommandType::ADD:
-            case CommandType::SUBTRACT:
-            case CommandType::MULTIPLY:
-            case CommandType::DIVIDE:
-            case CommandType::MOD:
-            case CommandType::NOT:
-            case CommandType::GREATER:
-            case CommandType::DUPLICATE:
-            case CommandType::ROLL:
-            case CommandType::INN:
-            case CommandType::INC:
-            case CommandType::OUTN:
-            case CommandType::OUTC:
-              dynamic_cast<SinglePathCommand *>(nodes[index].get())->next = nodes[next_index];
-              break;
-            case CommandType::POINTER:
-              {
-                dynamic_cast<MultiPathCommand *>(nodes[index].get())->nexts.emplace_back(nodes[next_index]);
-                int next_index2 = nindex*8 + ((dp+1)%4)*2 + cc;
-                dynamic_cast<MultiPathCommand *>(nodes[index].get())->nexts.emplace_back(nodes[next_index2]);
-                int next_index3 = nindex*8 + ((dp+2)%4)*2 + cc;
-                dynamic_cast<MultiPathCommand *>(nodes[index].get())->nexts.emplace_back(nodes[next_index3]);
-                int next_index4 = nindex*8 + ((dp+3)%4)*2 + cc;
-                dynamic_cast<MultiPathCommand *>(nodes[index].get())->nexts.emplace_back(nodes[next_index4]);
-              }
-              break;
-            case CommandType::SWITCH:
-              {
-                dynamic_cast<MultiPathCommand *>(nodes[index].get())->nexts.emplace_back(nodes[next_index]);
-                int next_index2 = nindex*8 + dp*2 + (cc+1)%2;
-                dynamic_cast<MultiPathCommand *>(nodes[index].get())->nexts.emplace_back(nodes[next_index2]);
-              }
-              break;
-            case CommandType::HALT:;
-          }
-        } else if (nindex >= 0) {
-          dynamic_cast<SinglePathCommand *>(nodes[index].get())->next = nodes[next_index];
+        const size_t index = i*8 + j*2 + k;
+        if (nindex < 0) continue;
+        const ConcreteCommandType type = conn
+          ? concrete_type(color_to_command(graph[i].get_color(), graph[nindex].get_color()))
+          : ConcreteCommandType::Nop;
+        ops[index] = type;
+        int32_t *next = &successors[index * max_nexts];
+        switch (type) {
+          case ConcreteCommandType::Halt:
+            break;
+          case ConcreteCommandType::Pointer:
+            for (size_t d = 0; d < 4; ++d) next[d] = nindex*8 + ((dp+d)%4)*2 + cc;
+            break;
+          case ConcreteCommandType::Switch:
+            for (size_t c = 0; c < 2; ++c) next[c] = nindex*8 + dp*2 + (cc+c)%2;
+            break;
+          case ConcreteCommandType::Push:
+            immediates[index] = graph[i].get_size();
+            next[0] = nindex*8 + dp*2 + cc;
+            break;
+          case ConcreteCommandType::Pop:
+            immediates[index] = 1;
+            next[0] = nindex*8 + dp*2 + cc;
+            break;
+          default:
+            next[0] = nindex*8 + dp*2 + cc;
         }
       }
     }
   }
 }
 
-CommandGraph::CommandGraph(const pas::PAS &pas) : nodes() {
+CommandGraph::CommandGraph(const pas::PAS &pas) {
   using namespace pas;
-  std::map<std::string, int> labels;
-  for (auto pasc : pas.commands) {
+  const size_t size = pas.commands.size();
+  resize(size);
+  for (size_t i = 0; i < size; ++i) {
+    const auto &pasc = pas.commands[i];
     switch (pasc.inst) {
       case PASCommandType::PUSH:
-        nodes.push_back(std::make_shared<Push>(pasc.arg1));
-        break;
-      case PASCommandType::DUP:
-        nodes.push_back(std::make_shared<Duplicate>());
-        break;
-      case PASCommandType::ROLL:
-        nodes.push_back(std::make_shared<Roll>());
-        break;
-      case PASCommandType::INN:
-        nodes.push_back(std::make_shared<InNumber>());
-        break;
-      case PASCommandType::INC:
-        nodes.push_back(std::make_shared<InChar>());
+        ops[i] = ConcreteCommandType::Push;
+        immediates[i] = pasc.arg1;
         break;
+      case PASCommandType::DUP: ops[i] = ConcreteCommandType::Duplicate; break;
+      case PASCommandType::ROLL: ops[i] = ConcreteCommandType::Roll; break;
+      case PASCommandType::INN: ops[i] = ConcreteCommandType::InNumber; break;
+      case PASCommandType::INC: ops[i] = ConcreteCommandType::InChar; break;
       case PASCommandType::POP:
-        nodes.push_back(std::make_shared<Pop>());
+        ops[i] = ConcreteCommandType::Pop;
+        immediates[i] = 1;
         break;
-      case PASCommandType::OUTN:
-        nodes.push_back(std::make_shared<OutNumber>());
+      case PASCommandType::OUTN: ops[i] = ConcreteCommandType::OutNumber; break;
+      case PASCommandType::OUTC: ops[i] = ConcreteCommandType::OutChar; break;
+      case PASCommandType::ADD: ops[i] = ConcreteCommandType::Add; break;
+      case PASCommandType::SUB: ops[i] = ConcreteCommandType::Subtract; break;
+      case PASCommandType::MUL: ops[i] = ConcreteCommandType::Multiply; break;
+      case PASCommandType::DIV: ops[i] = ConcreteCommandType::Divide; break;
+      case PASCommandType::MOD: ops[i] = ConcreteCommandType::Modulo; break;
+      case PASCommandType::GREATER: ops[i] = ConcreteCommandType::Greater; break;
+      case PASCommandType::NOT: ops[i] = ConcreteCommandType::Not; break;
+      case PASCommandType::HALT: ops[i] = ConcreteCommandType::Halt; break;
+      case PASCommandType::LABEL: ops[i] = ConcreteCommandType::Nop; break;
+      case PASCommandType::JEZ: ops[i] = ConcreteCommandType::Jez; break;
+      case PASCommandType::JMP: ops[i] = ConcreteCommandType::Nop; break;
+      case PASCommandType::SWAP: ops[i] = ConcreteCommandType::Swap; break;
+      default:
+        throw std::domain_error("Unknown PAS command");
+    }
+  }
+  for (size_t i = 0; i + 1 < size; ++i) {
+    int32_t *next = &successors[i * max_nexts];
+    switch (pas.commands[i].inst) {
+      case PASCommandType::HALT: break;
+      case PASCommandType::JEZ:
+        next[0] = i+1;
+        next[1] = pas.commands[i].arg1;
         break;
-      case PASCommandType::OUTC:
-        nodes.push_back(std::make_shared<OutChar>());
+      case PASCommandType::JMP:
+        next[0] = pas.commands[i].arg1;
         break;
-      case PASCommandType::ADD:
-        nodes.push_back(std::make_shared<Add>());
+      default:
+        next[0] = i+1;
+    }
+  }
+}
+
+size_t CommandGraph::next_count(const size_t node) const {
+  switch (ops[node]) {
+    case ConcreteCommandType::Halt: return 0;
+    case ConcreteCommandType::Switch:
+    case ConcreteCommandType::Jez: return 2;
+    case ConcreteCommandType::Pointer: return 4;
+    default: return 1;
+  }
+}
+
+// Hopcroft's partition refinement. Nodes reachable from node 0 start out
+// grouped by command and immediate, with one extra node standing for the
+// unset successors. A class is split whenever some of its nodes lead into a
+// splitter class through a slot and others do not; after a split only the
+// smaller half has to serve as a splitter, unless the class was still
+// waiting to serve as one. The stable classes become the new nodes.
+void CommandGraph::minimize() {
+  std::vector<int32_t> id(size(), -1), order(1, 0);
+  id[0] = 0;
+  for (size_t i = 0; i < order.size(); ++i) {
+    const int32_t *next = nexts(order[i]);
+    for (size_t j = 0; j < next_count(order[i]); ++j) {
+      if (next[j] >= 0 && id[next[j]] < 0) {
+        id[next[j]] = order.size();
+        order.push_back(next[j]);
+      }
+    }
+  }
+  const int32_t sink = order.size(), count = sink + 1;
+  auto target = [&](const int32_t u, const size_t slot) {
+    const int32_t t = nexts(order[u])[slot];
+    return t < 0 ? sink : id[t];
+  };
+
+  // predecessors of each node with the slot leading there
+  std::vector<int32_t> pred_begin(count + 1, 0);
+  for (int32_t u = 0; u < sink; ++u) {
+    for (size_t j = 0; j < next_count(order[u]); ++j) ++pred_begin[target(u, j) + 1];
+  }
+  for (int32_t u = 0; u < count; ++u) pred_begin[u+1] += pred_begin[u];
+  std::vector<int32_t> pred_source(pred_begin[count]), fill(begin(pred_begin), end(pred_begin) - 1);
+  std::vector<uint8_t> pred_slot(pred_begin[count]);
+  for (int32_t u = 0; u < sink; ++u) {
+    for (size_t j = 0; j < next_count(order[u]); ++j) {
+      const int32_t k = fill[target(u, j)]++;
+      pred_source[k] = u;
+      pred_slot[k] = j;
+    }
+  }
+
+  // the nodes of class c are elems[first[c]..last[c]), the marked ones
+  // coming first, up to mid[c]
+  std::vector<int32_t> cls(count), elems(count), loc(count);
+  std::vector<int32_t> first, mid, last;
+  {
+    std::map<std::pair<ConcreteCommandType, int32_t>, int32_t> initial;
+    std::vector<int32_t> sizes;
+    for (int32_t u = 0; u < sink; ++u) {
+      const auto key = std::make_pair(ops[order[u]], immediates[order[u]]);
+      const auto res = initial.emplace(key, sizes.size());
+      if (res.second) sizes.push_back(0);
+      cls[u] = res.first->second;
+      ++sizes[cls[u]];
+    }
+    cls[sink] = sizes.size();
+    sizes.push_back(1);
+    for (const int32_t n : sizes) {
+      first.push_back(first.empty() ? 0 : last.back());
+      last.push_back(first.back() + n);
+    }
+    mid = first;
+    std::vector<int32_t> pos(first);
+    for (int32_t u = 0; u < count; ++u) {
+      loc[u] = pos[cls[u]]++;
+      elems[loc[u]] = u;
+    }
+  }
+  // a class is used as a splitter for all slots at once
+  std::vector<int32_t> work(first.size());
+  std::vector<bool> waiting(first.size(), true);
+  for (size_t c = 0; c < first.size(); ++c) work[c] = c;
+  std::array<std::vector<int32_t>, max_nexts> sources;
+  std::vector<int32_t> touched;
+  while (!work.empty()) {
+    const int32_t splitter = work.back();
+    work.pop_back();
+    waiting[splitter] = false;
+    for (int32_t k = first[splitter]; k < last[splitter]; ++k) {
+      const int32_t x = elems[k];
+      for (int32_t e = pred_begin[x]; e < pred_begin[x+1]; ++e) {
+        sources[pred_slot[e]].push_back(pred_source[e]);
+      }
+    }
+    for (auto &slot_sources : sources) {
+      for (const int32_t u : slot_sources) {
+        const int32_t c = cls[u];
+        if (loc[u] < mid[c]) continue;
+        if (mid[c] == first[c]) touched.push_back(c);
+        const int32_t other = elems[mid[c]];
+        std::swap(elems[loc[u]], elems[mid[c]]);
+        loc[other] = loc[u];
+        loc[u] = mid[c]++;
+      }
+      slot_sources.clear();
+      for (const int32_t c : touched) {
+        if (mid[c] == last[c]) {
+          mid[c] = first[c];
+          continue;
+        }
+        // the marked nodes move to a new class
+        const int32_t split = first.size();
+        first.push_back(first[c]);
+        last.push_back(mid[c]);
+        mid.push_back(first[c]);
+        first[c] = mid[c];
+        for (int32_t k = first[split]; k < last[split]; ++k) cls[elems[k]] = split;
+        const bool smaller = last[split] - first[split] < last[c] - first[c];
+        waiting.push_back(waiting[c] || smaller);
+        if (waiting[split]) {
+          work.push_back(split);
+        } else {
+          waiting[c] = true;
+          work.push_back(c);
+        }
+      }
+      touched.clear();
+    }
+  }
+
+  // classes are numbered by their first node in breadth-first order
+  std::vector<int32_t> renumber(first.size(), -1), reps;
+  for (int32_t u = 0; u < sink; ++u) {
+    if (renumber[cls[u]] >= 0) continue;
+    renumber[cls[u]] = reps.size();
+    reps.push_back(u);
+  }
+  std::vector<ConcreteCommandType> new_ops(reps.size());
+  std::vector<int32_t> new_immediates(reps.size()), new_successors(reps.size() * max_nexts, -1);
+  for (size_t i = 0; i < reps.size(); ++i) {
+    const int32_t u = reps[i];
+    new_ops[i] = ops[order[u]];
+    new_immediates[i] = immediates[order[u]];
+    for (size_t j = 0; j < next_count(order[u]); ++j) {
+      const int32_t t = target(u, j);
+      if (t != sink) new_successors[i * max_nexts + j] = renumber[cls[t]];
+    }
+  }
+  ops = std::move(new_ops);
+  immediates = std::move(new_immediates);
+  successors = std::move(new_successors);
+}
+
+std::shared_ptr<Command> CommandGraph::make_command(const size_t node) const {
+  switch (ops[node]) {
+    case ConcreteCommandType::Switch: return std::make_shared<Switch>();
+    case ConcreteCommandType::Pointer: return std::make_shared<Pointer>();
+    case ConcreteCommandType::Jez: return std::make_shared<Jez>();
+    case ConcreteCommandType::Halt: return std::make_shared<Halt>();
+    case ConcreteCommandType::Nop: return std::make_shared<Nop>();
+    case ConcreteCommandType::Push: return std::make_shared<Push>(immediates[node]);
+    case ConcreteCommandType::Duplicate: return std::make_shared<Duplicate>();
+    case ConcreteCommandType::InNumber: return std::make_shared<InNumber>();
+    case ConcreteCommandType::InChar: return std::make_shared<InChar>();
+    case ConcreteCommandType::Pop: return std::make_shared<Pop>(immediates[node]);
+    case ConcreteCommandType::OutNumber: return std::make_shared<OutNumber>();
+    case ConcreteCommandType::OutChar: return std::make_shared<OutChar>();
+    case ConcreteCommandType::Add: return std::make_shared<Add>();
+    case ConcreteCommandType::Subtract: return std::make_shared<Subtract>();
+    case ConcreteCommandType::Multiply: return std::make_shared<Multiply>();
+    case ConcreteCommandType::Divide: return std::make_shared<Divide>();
+    case ConcreteCommandType::Modulo: return std::make_shared<Modulo>();
+    case ConcreteCommandType::Greater: return std::make_shared<Greater>();
+    case ConcreteCommandType::Not: return std::make_shared<Not>();
+    case ConcreteCommandType::Swap: return std::make_shared<Swap>();
+    case ConcreteCommandType::Roll: return std::make_shared<Roll>();
+    default: throw std::domain_error("Unknown ConcreteCommandType");
+  }
+}
+
+// Runs the nodes one at a time; an unset successor ends the program like Halt.
+void CommandGraph::exec() const {
+  Stack stack;
+  int32_t node = 0;
+  while (node >= 0) {
+    const int32_t *next = nexts(node);
+    int32_t slot = 0;
+    switch (ops[node]) {
+      case ConcreteCommandType::Halt:
+        return;
+      case ConcreteCommandType::Switch:
+      case ConcreteCommandType::Pointer:
+      case ConcreteCommandType::Jez:
+        if (!stack.empty()) {
+          const int32_t value = stack.top();
+          stack.pop();
+          if (ops[node] == ConcreteCommandType::Jez) {
+            slot = value == 0 ? 1 : 0;
+          } else {
+            slot = mod(value, ops[node] == ConcreteCommandType::Switch ? 2 : 4);
+          }
+        }
         break;
-      case PASCommandType::SUB:
-        nodes.push_back(std::make_shared<Subtract>());
+      case ConcreteCommandType::Push:
+        stack.push(immediates[node]);
         break;
-      case PASCommandType::MUL:
-        nodes.push_back(std::make_shared<Multiply>());
+      case ConcreteCommandType::Duplicate:
+        if (!stack.empty()) stack.push(stack.top());
         break;
-      case PASCommandType::DIV:
-        nodes.push_back(std::make_shared<Divide>());
+      case ConcreteCommandType::InNumber:
+        stack.push(io32::getnumber());
         break;
-      case PASCommandType::MOD:
-        nodes.push_back(std::make_shared<Modulo>());
+      case ConcreteCommandType::InChar:
+        stack.push(io32::getchar());
         break;
-      case PASCommandType::GREATER:
-        nodes.push_back(std::make_shared<Greater>());
+      case ConcreteCommandType::Pop:
+        for (int32_t i = 0; i < immediates[node] && !stack.empty(); ++i) stack.pop();
         break;
-      case PASCommandType::NOT:
-        nodes.push_back(std::make_shared<Not>());
+      case ConcreteCommandType::OutNumber:
+        if (!stack.empty()) {
+          io32::putnumber(stack.top());
+          stack.pop();
+        }
         break;
-      case PASCommandType::HALT:
-        nodes.push_back(std::make_shared<Halt>());
+      case ConcreteCommandType::OutChar:
+        if (!stack.empty()) {
+          io32::putchar(stack.top());
+          stack.pop();
+        }
         break;
-      case PASCommandType::LABEL:
-        nodes.push_back(std::make_shared<Nop>());
+      case ConcreteCommandType::Add:
+      case ConcreteCommandType::Subtract:
+      case ConcreteCommandType::Multiply:
+      case ConcreteCommandType::Divide:
+      case ConcreteCommandType::Modulo:
+      case ConcreteCommandType::Greater:
+        if (stack.size() >= 2) {
+          const int32_t rhs = stack.top(); stack.pop();
+          const int32_t lhs = stack.top(); stack.pop();
+          switch (ops[node]) {
+            case ConcreteCommandType::Add: stack.push(lhs + rhs); break;
+            case ConcreteCommandType::Subtract: stack.push(lhs - rhs); break;
+            case ConcreteCommandType::Multiply: stack.push(lhs * rhs); break;
+            case ConcreteCommandType::Greater: stack.push(lhs > rhs ? 1 : 0); break;
+            default:
+              if (rhs == 0) {
+                stack.push(lhs);
+                stack.push(rhs);
+              } else {
+                stack.push(ops[node] == ConcreteCommandType::Divide ? lhs / rhs : lhs % rhs);
+              }
+          }
+        }
         break;
-      case PASCommandType::JEZ:
-        nodes.push_back(std::make_shared<Jez>());
+      case ConcreteCommandType::Not:
+        if (!stack.empty()) {
+          const int32_t top = stack.top(); stack.pop();
+          stack.push(top ? 0 : 1);
+        }
         break;
-      case PASCommandType::JMP:
-        nodes.push_back(std::make_shared<Nop>());
+      case ConcreteCommandType::Swap:
+        if (stack.size() >= 2) {
+          const int32_t rhs = stack.top(); stack.pop();
+          const int32_t lhs = stack.top(); stack.pop();
+          stack.push(rhs);
+          stack.push(lhs);
+        }
         break;
-      case PASCommandType::SWAP:
-        nodes.push_back(std::make_shared<Swap>());
+      case ConcreteCommandType::Roll:
+        if (stack.size() >= 2) {
+          const int32_t iter = stack.top(); stack.pop();
+          const int32_t depth = stack.top(); stack.pop();
+          if (depth >= 0 && stack.size() >= static_cast<size_t>(depth)) {
+            if (depth > 0) stack.roll(depth, mod(iter, depth));
+          } else {
+            stack.push(depth);
+            stack.push(iter);
+          }
+        }
         break;
       default:
-        throw new std::domain_error("Unknown PAS command");
-    }
-  }
-  for (size_t i = 0; i < nodes.size() - 1; ++i) {
-    switch (pas.commands[i].inst) {
-      case PASCommandType::HALT: break;
-      case PASCommandType::JEZ:
-        dynamic_cast<MultiPathCommand *>(nodes[i].get())->nexts.emplace_back(nodes[i+1]);
-        dynamic_cast<MultiPathCommand *>(nodes[i].get())->nexts.emplace_back(nodes[pas.commands[i].arg1]);
         break;
-      case PASCommandType::JMP:
-        dynamic_cast<SinglePathCommand *>(nodes[i].get())->next = nodes[pas.commands[i].arg1];
-        break;
-      default:
-      dynamic_cast<SinglePathCommand *>(nodes[i].get())->next = nodes[i+1];
     }
-  }
-}
-
-void CommandGraph::exec() const {
-  Stack stack;
-  std::shared_ptr<Command> prog_ptr = nodes.front();
-  while (prog_ptr) {
-    //std::cerr << (std::find(std::begin(nodes), std::end(nodes), prog_ptr) - std::begin(nodes)) << std::endl;
-    //std::cerr << stack.to_s() << std::endl;
-    prog_ptr = prog_ptr->exec(stack);
+    node = next[slot];
   }
 }
@@ -14,7 +14,11 @@ class Stack {
   bool empty() const { return data.empty(); }
   std::size_t size() const { return data.size(); }
   void pop() { data.pop_back(); }
+  // element `depth` places below the top
+  int32_t peek(const std::size_t depth) const { return data[data.size() - 1 - depth]; }
+  void drop(const std::size_t count) { data.resize(data.size() - count); }
   void push(const int32_t x) { data.push_back(x); }
+  void reserve(const std::size_t capacity) { data.reserve(capacity); }
   void push_array(const std::vector<int32_t> &ary) {
     using std::begin;
     using std::end;
@@ -32,7 +36,9 @@ class Stack {
   std::vector<int32_t> data;
 };
 
-enum class ConcreteCommandType {
+int32_t mod(int32_t x, int32_t d);
+
+enum class ConcreteCommandType : uint8_t {
   Switch,
   Pointer,
   Jez,
@@ -54,28 +60,30 @@ enum class ConcreteCommandType {
   Greater,
   Not,
   Swap,
-  Roll
+  Roll,
+  AddImm,
+  SubImm,
+  MulImm,
+  NotNot,
+  RollConst,
+  DupBranchZero
 };
 
+std::string command_name(const ConcreteCommandType);
+
 class Command {
  public:
-  virtual std::shared_ptr<Command> exec(Stack &) const = 0;
-  virtual std::vector<std::shared_ptr<Command>> get_nexts() const = 0;
+  // index of the successor taken, -1 to halt
+  virtual int32_t exec(Stack &) const = 0;
+  // same as exec when the stack is known to hold enough elements
+  virtual int32_t exec_unchecked(Stack &stack) const { return exec(stack); }
   virtual std::string to_cpp_string() const = 0;
+  virtual std::string to_unchecked_cpp_string() const { return to_cpp_string(); }
   virtual ConcreteCommandType command_type() const = 0;
 };
 
+// closes its block and picks one of the block's successors
 class MultiPathCommand : public Command {
- public:
-  explicit MultiPathCommand() : nexts() {}
-  std::vector<std::weak_ptr<Command>> nexts;
-  virtual std::vector<std::shared_ptr<Command>> get_nexts() const override final {
-    std::vector<std::shared_ptr<Command>> res;
-    for (const auto &next : nexts) {
-      res.push_back(next.lock());
-    }
-    return res;
-  }
 };
 
 class Switch : public MultiPathCommand {
@@ -83,7 +91,11 @@ class Switch : public MultiPathCommand {
   virtual std::string to_cpp_string() const override final {
     return "  switch(stack.switch_()) {\n";
   }
-  virtual std::shared_ptr<Command> exec(Stack &) const override final;
+  virtual std::string to_unchecked_cpp_string() const override final {
+    return "  switch(stack.switch_unchecked()) {\n";
+  }
+  virtual int32_t exec(Stack &) const override final;
+  virtual int32_t exec_unchecked(Stack &) const override final;
   virtual ConcreteCommandType command_type() const override final {
     return ConcreteCommandType::Switch;
   }
@@ -94,7 +106,11 @@ class Pointer : public MultiPathCommand {
   virtual std::string to_cpp_string() const override final {
     return "  switch(stack.pointer()) {\n";
   }
-  virtual std::shared_ptr<Command> exec(Stack &) const override final;
+  virtual std::string to_unchecked_cpp_string() const override final {
+    return "  switch(stack.pointer_unchecked()) {\n";
+  }
+  virtual int32_t exec(Stack &) const override final;
+  virtual int32_t exec_unchecked(Stack &) const override final;
   virtual ConcreteCommandType command_type() const override final {
     return ConcreteCommandType::Pointer;
   }
@@ -105,7 +121,11 @@ class Jez : public MultiPathCommand {
   virtual std::string to_cpp_string() const override final {
     return "  switch(stack.eq_zero()) {\n";
   }
-  virtual std::shared_ptr<Command> exec(Stack &) const override final;
+  virtual std::string to_unchecked_cpp_string() const override final {
+    return "  switch(stack.eq_zero_unchecked()) {\n";
+  }
+  virtual int32_t exec(Stack &) const override final;
+  virtual int32_t exec_unchecked(Stack &) const override final;
   virtual ConcreteCommandType command_type() const override final {
     return ConcreteCommandType::Jez;
   }
@@ -114,11 +134,8 @@ class Jez : public MultiPathCommand {
 class Halt : public Command {
  public:
   Halt() {}
-  virtual std::shared_ptr<Command> exec(Stack &) const override final {
-    return std::shared_ptr<Command>();
-  }
-  virtual std::vector<std::shared_ptr<Command>> get_nexts() const override final {
-    return std::vector<std::shared_ptr<Command>>();
+  virtual int32_t exec(Stack &) const override final {
+    return -1;
   }
   virtual std::string to_cpp_string() const override final {
     return "  std::exit(0);\n";
@@ -128,22 +145,15 @@ class Halt : public Command {
   }
 };
 
+// goes on to the next command, or to the block's only successor (slot 0)
 class SinglePathCommand : public Command {
- public:
-  SinglePathCommand() : next() {};
-  explicit SinglePathCommand(const std::weak_ptr<Command> &next)
-    : next(next) {}
-  std::weak_ptr<Command> next;
-  virtual std::vector<std::shared_ptr<Command>> get_nexts() const override final {
-    return std::vector<std::shared_ptr<Command>>(1, next.lock());
-  }
 };
 
 class Nop : public SinglePathCommand {
  public:
-  Nop() : SinglePathCommand() {}
-  virtual std::shared_ptr<Command> exec(Stack &) const override final {
-    return next.lock();
+  Nop() {}
+  virtual int32_t exec(Stack &) const override final {
+    return 0;
   }
   virtual std::string to_cpp_string() const override final {
     return "";
@@ -155,8 +165,8 @@ class Nop : public SinglePathCommand {
 
 class Push : public SinglePathCommand {
  public:
-  explicit Push(int value) : SinglePathCommand(), value(value) {}
-  std::shared_ptr<Command> exec(Stack &) const override final;
+  explicit Push(int value) : value(value) {}
+  int32_t exec(Stack &) const override final;
   virtual std::string to_cpp_string() const override final {
     return "  stack.push(" + std::to_string(value) + ");\n";
   }
@@ -171,8 +181,8 @@ class Push : public SinglePathCommand {
 class PushArray : public SinglePathCommand {
  public:
   explicit PushArray(const std::vector<int32_t> &ary)
-    : SinglePathCommand(), data(ary) {}
-  std::shared_ptr<Command> exec(Stack &) const override final;
+    : data(ary) {}
+  int32_t exec(Stack &) const override final;
   virtual std::string to_cpp_string() const override final {
     std::stringstream ss;
     ss << "  {\n";
@@ -188,17 +198,22 @@ class PushArray : public SinglePathCommand {
   virtual ConcreteCommandType command_type() const override final {
     return ConcreteCommandType::PushArray;
   }
+  const std::vector<int32_t> &get_data() const { return data; }
  private:
   std::vector<int32_t> data;
 };
 
 class Duplicate : public SinglePathCommand {
  public:
-  Duplicate() : SinglePathCommand() {}
-  std::shared_ptr<Command> exec(Stack &) const override final;
+  Duplicate() {}
+  int32_t exec(Stack &) const override final;
+  int32_t exec_unchecked(Stack &) const override final;
   virtual std::string to_cpp_string() const override final {
     return "  stack.duplicate();\n";
   }
+  virtual std::string to_unchecked_cpp_string() const override final {
+    return "  stack.duplicate_unchecked();\n";
+  }
   virtual ConcreteCommandType command_type() const override final {
     return ConcreteCommandType::Duplicate;
   }
@@ -206,8 +221,8 @@ class Duplicate : public SinglePathCommand {
 
 class InNumber : public SinglePathCommand {
  public:
-  InNumber() : SinglePathCommand() {}
-  std::shared_ptr<Command> exec(Stack &) const override final;
+  InNumber() {}
+  int32_t exec(Stack &) const override final;
   virtual std::string to_cpp_string() const override final {
     return "  stack.push(get_number());\n";
   }
@@ -218,8 +233,8 @@ class InNumber : public SinglePathCommand {
 
 class InChar : public SinglePathCommand {
  public:
-  InChar() : SinglePathCommand() {}
-  std::shared_ptr<Command> exec(Stack &) const override final;
+  InChar() {}
+  int32_t exec(Stack &) const override final;
   virtual std::string to_cpp_string() const override final {
     return "  stack.push(get_char());\n";
   }
@@ -230,9 +245,10 @@ class InChar : public SinglePathCommand {
 
 class Pop : public SinglePathCommand {
  public:
-  Pop() : SinglePathCommand(), count(1) {}
-  Pop(int32_t count) : SinglePathCommand(), count(count) {}
-  std::shared_ptr<Command> exec(Stack &) const override final;
+  Pop() : count(1) {}
+  Pop(int32_t count) : count(count) {}
+  int32_t exec(Stack &) const override final;
+  int32_t exec_unchecked(Stack &) const override final;
   virtual std::string to_cpp_string() const override final {
     std::stringstream ss;
     if (count > 1) {
@@ -246,20 +262,28 @@ class Pop : public SinglePathCommand {
     }
     return ss.str();
   }
+  virtual std::string to_unchecked_cpp_string() const override final {
+    return "  stack.drop(" + std::to_string(count) + ");\n";
+  }
   virtual ConcreteCommandType command_type() const override final {
     return ConcreteCommandType::Pop;
   }
+  int32_t get_count() const { return count; }
  private:
   int32_t count;
 };
 
 class OutNumber : public SinglePathCommand {
  public:
-  OutNumber() : SinglePathCommand() {}
-  std::shared_ptr<Command> exec(Stack &) const override final;
+  OutNumber() {}
+  int32_t exec(Stack &) const override final;
+  int32_t exec_unchecked(Stack &) const override final;
   virtual std::string to_cpp_string() const override final {
     return "  stack.out_number();\n";
   }
+  virtual std::string to_unchecked_cpp_string() const override final {
+    return "  stack.out_number_unchecked();\n";
+  }
   virtual ConcreteCommandType command_type() const override final {
     return ConcreteCommandType::OutNumber;
   }
@@ -267,11 +291,15 @@ class OutNumber : public SinglePathCommand {
 
 class OutChar: public SinglePathCommand {
  public:
-  OutChar() : SinglePathCommand() {}
-  std::shared_ptr<Command> exec(Stack &) const override final;
+  OutChar() {}
+  int32_t exec(Stack &) const override final;
+  int32_t exec_unchecked(Stack &) const override final;
   virtual std::string to_cpp_string() const override final {
     return "  stack.out_char();\n";
   }
+  virtual std::string to_unchecked_cpp_string() const override final {
+    return "  stack.out_char_unchecked();\n";
+  }
   virtual ConcreteCommandType command_type() const override final {
     return ConcreteCommandType::OutChar;
   }
@@ -279,7 +307,8 @@ class OutChar: public SinglePathCommand {
 
 class BinaryOp : public SinglePathCommand {
  public:
-  std::shared_ptr<Command> exec(Stack &) const noexcept override final;
+  int32_t exec(Stack &) const noexcept override final;
+  int32_t exec_unchecked(Stack &) const noexcept override final;
  private:
   virtual int bin_op(int, int) const = 0;
 };
@@ -289,6 +318,9 @@ class Add : public BinaryOp {
   virtual std::string to_cpp_string() const override final {
     return "  stack.add();\n";
   }
+  virtual std::string to_unchecked_cpp_string() const override final {
+    return "  stack.add_unchecked();\n";
+  }
   virtual ConcreteCommandType command_type() const override final {
     return ConcreteCommandType::Add;
   }
@@ -301,6 +333,9 @@ class Subtract : public BinaryOp {
   virtual std::string to_cpp_string() const override final {
     return "  stack.sub();\n";
   }
+  virtual std::string to_unchecked_cpp_string() const override final {
+    return "  stack.sub_unchecked();\n";
+  }
   virtual ConcreteCommandType command_type() const override final {
     return ConcreteCommandType::Subtract;
   }
@@ -313,6 +348,9 @@ class Multiply : public BinaryOp {
   virtual std::string to_cpp_string() const override final {
     return "  stack.mul();\n";
   }
+  virtual std::string to_unchecked_cpp_string() const override final {
+    return "  stack.mul_unchecked();\n";
+  }
   virtual ConcreteCommandType command_type() const override final {
     return ConcreteCommandType::Multiply;
   }
@@ -325,6 +363,9 @@ class Divide : public BinaryOp {
   virtual std::string to_cpp_string() const override final {
     return "  stack.div();\n";
   }
+  virtual std::string to_unchecked_cpp_string() const override final {
+    return "  stack.div_unchecked();\n";
+  }
   virtual ConcreteCommandType command_type() const override final {
     return ConcreteCommandType::Divide;
   }
@@ -337,6 +378,9 @@ class Modulo : public BinaryOp {
   virtual std::string to_cpp_string() const override final {
     return "  stack.mod();\n";
   }
+  virtual std::string to_unchecked_cpp_string() const override final {
+    return "  stack.mod_unchecked();\n";
+  }
   virtual ConcreteCommandType command_type() const override final {
     return ConcreteCommandType::Modulo;
   }
@@ -349,6 +393,9 @@ class Greater : public BinaryOp {
   virtual std::string to_cpp_string() const override final {
     return "  stack.greater();\n";
   }
+  virtual std::string to_unchecked_cpp_string() const override final {
+    return "  stack.greater_unchecked();\n";
+  }
   virtual ConcreteCommandType command_type() const override final {
     return ConcreteCommandType::Greater;
   }
@@ -361,7 +408,11 @@ class Not : public SinglePathCommand {
   virtual std::string to_cpp_string() const override final {
     return "  stack.not_();\n";
   }
-  virtual std::shared_ptr<Command> exec(Stack &) const override final;
+  virtual std::string to_unchecked_cpp_string() const override final {
+    return "  stack.not_unchecked();\n";
+  }
+  virtual int32_t exec(Stack &) const override final;
+  virtual int32_t exec_unchecked(Stack &) const override final;
   virtual ConcreteCommandType command_type() const override final {
     return ConcreteCommandType::Not;
   }
@@ -372,8 +423,12 @@ class Swap: public SinglePathCommand {
   virtual std::string to_cpp_string() const override final {
     return "  stack.swap();\n";
   }
-  Swap() : SinglePathCommand() {}
-  virtual std::shared_ptr<Command> exec(Stack &) const override final;
+  virtual std::string to_unchecked_cpp_string() const override final {
+    return "  stack.swap_unchecked();\n";
+  }
+  Swap() {}
+  virtual int32_t exec(Stack &) const override final;
+  virtual int32_t exec_unchecked(Stack &) const override final;
   virtual ConcreteCommandType command_type() const override final {
     return ConcreteCommandType::Swap;
   }
@@ -384,19 +439,158 @@ class Roll: public SinglePathCommand {
   virtual std::string to_cpp_string() const override final {
     return "  stack.roll();\n";
   }
-  Roll() : SinglePathCommand() {}
-  virtual std::shared_ptr<Command> exec(Stack &) const override final;
+  virtual std::string to_unchecked_cpp_string() const override final {
+    return "  stack.roll_unchecked();\n";
+  }
+  Roll() {}
+  virtual int32_t exec(Stack &) const override final;
+  virtual int32_t exec_unchecked(Stack &) const override final;
   virtual ConcreteCommandType command_type() const override final {
     return ConcreteCommandType::Roll;
   }
 };
 
+// Fused forms produced by BasicBlock::fuse
+
+// Push value; Add
+class AddImm : public SinglePathCommand {
+ public:
+  explicit AddImm(int32_t value) : value(value) {}
+  virtual std::string to_cpp_string() const override final {
+    return "  stack.add_imm(" + std::to_string(value) + ");\n";
+  }
+  virtual std::string to_unchecked_cpp_string() const override final {
+    return "  stack.add_imm_unchecked(" + std::to_string(value) + ");\n";
+  }
+  virtual int32_t exec(Stack &) const override final;
+  virtual int32_t exec_unchecked(Stack &) const override final;
+  virtual ConcreteCommandType command_type() const override final {
+    return ConcreteCommandType::AddImm;
+  }
+  int32_t get_value() const { return value; }
+ private:
+  int32_t value;
+};
+
+// Push value; Subtract
+class SubImm : public SinglePathCommand {
+ public:
+  explicit SubImm(int32_t value) : value(value) {}
+  virtual std::string to_cpp_string() const override final {
+    return "  stack.sub_imm(" + std::to_string(value) + ");\n";
+  }
+  virtual std::string to_unchecked_cpp_string() const override final {
+    return "  stack.sub_imm_unchecked(" + std::to_string(value) + ");\n";
+  }
+  virtual int32_t exec(Stack &) const override final;
+  virtual int32_t exec_unchecked(Stack &) const override final;
+  virtual ConcreteCommandType command_type() const override final {
+    return ConcreteCommandType::SubImm;
+  }
+  int32_t get_value() const { return value; }
+ private:
+  int32_t value;
+};
+
+// Push value; Multiply
+class MulImm : public SinglePathCommand {
+ public:
+  explicit MulImm(int32_t value) : value(value) {}
+  virtual std::string to_cpp_string() const override final {
+    return "  stack.mul_imm(" + std::to_string(value) + ");\n";
+  }
+  virtual std::string to_unchecked_cpp_string() const override final {
+    return "  stack.mul_imm_unchecked(" + std::to_string(value) + ");\n";
+  }
+  virtual int32_t exec(Stack &) const override final;
+  virtual int32_t exec_unchecked(Stack &) const override final;
+  virtual ConcreteCommandType command_type() const override final {
+    return ConcreteCommandType::MulImm;
+  }
+  int32_t get_value() const { return value; }
+ private:
+  int32_t value;
+};
+
+// Not; Not
+class NotNot : public SinglePathCommand {
+ public:
+  virtual std::string to_cpp_string() const override final {
+    return "  stack.not_not();\n";
+  }
+  virtual std::string to_unchecked_cpp_string() const override final {
+    return "  stack.not_not_unchecked();\n";
+  }
+  virtual int32_t exec(Stack &) const override final;
+  virtual int32_t exec_unchecked(Stack &) const override final;
+  virtual ConcreteCommandType command_type() const override final {
+    return ConcreteCommandType::NotNot;
+  }
+};
+
+// Push depth; Push iter; Roll
+class RollConst : public SinglePathCommand {
+ public:
+  RollConst(int32_t depth, int32_t iter)
+    : depth(depth), iter(iter) {}
+  virtual std::string to_cpp_string() const override final {
+    return "  stack.roll_const(" + std::to_string(depth) + ", " + std::to_string(iter) + ");\n";
+  }
+  virtual std::string to_unchecked_cpp_string() const override final {
+    return "  stack.roll_const_unchecked(" + std::to_string(depth) + ", " + std::to_string(iter) + ");\n";
+  }
+  virtual int32_t exec(Stack &) const override final;
+  virtual int32_t exec_unchecked(Stack &) const override final;
+  virtual ConcreteCommandType command_type() const override final {
+    return ConcreteCommandType::RollConst;
+  }
+  int32_t get_depth() const { return depth; }
+  int32_t get_iter() const { return iter; }
+ private:
+  int32_t depth;
+  int32_t iter;
+};
+
+// Duplicate; Jez
+class DupBranchZero : public MultiPathCommand {
+ public:
+  virtual std::string to_cpp_string() const override final {
+    return "  switch(stack.dup_eq_zero()) {\n";
+  }
+  virtual std::string to_unchecked_cpp_string() const override final {
+    return "  switch(stack.dup_eq_zero_unchecked()) {\n";
+  }
+  virtual int32_t exec(Stack &) const override final;
+  virtual int32_t exec_unchecked(Stack &) const override final;
+  virtual ConcreteCommandType command_type() const override final {
+    return ConcreteCommandType::DupBranchZero;
+  }
+};
+
+// Commands as flat arrays indexed by node. A colour block has eight nodes,
+// block * 8 + dp * 2 + cc, and a PAS program one per instruction; node 0 is
+// the entry. Each node has max_nexts successor slots in the order its
+// command selects them, the unused ones and those of Halt being -1.
+// minimize renumbers the nodes, after which only node 0 keeps its meaning.
 class CommandGraph {
  public:
+  static constexpr size_t max_nexts = 4;
   explicit CommandGraph(const ColorBlockGraph &);
   explicit CommandGraph(const pas::PAS &);
   void exec() const;
-  std::shared_ptr<Command> root() const { return nodes.front(); }
+  // merges the nodes that behave the same and drops those node 0 never reaches
+  void minimize();
+  size_t size() const { return ops.size(); }
+  ConcreteCommandType op(const size_t node) const { return ops[node]; }
+  // the value of Push, the count of Pop
+  int32_t immediate(const size_t node) const { return immediates[node]; }
+  const int32_t *nexts(const size_t node) const { return &successors[node * max_nexts]; }
+  size_t next_count(const size_t node) const;
+  // a new command for node
+  std::shared_ptr<Command> make_command(const size_t node) const;
  private:
-  std::vector<std::shared_ptr<Command>> nodes;
+  void resize(const size_t size);
+  std::vector<ConcreteCommandType> ops;
+  std::vector<int32_t> immediates;
+  std::vector<int32_t> successors;
 };
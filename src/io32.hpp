@@ -1,9 +1,12 @@
+#pragma once
 #include <string>
 
 namespace io32 {
 
 using int_type = std::char_traits<char32_t>::int_type;
 int_type getchar();
+int_type getnumber();
 void putchar(const int_type);
+void putnumber(const int_type);
 
 } // namespace iobuf
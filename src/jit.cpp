@@ -0,0 +1,456 @@
+#include "jit.hpp"
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <sys/mman.h>
+#include "io32.hpp"
+
+namespace {
+
+struct JitState {
+  int32_t *data;
+  int64_t size;
+  int64_t capacity;
+  int64_t need;
+  std::vector<int32_t> *storage;
+};
+
+constexpr int8_t data_offset = offsetof(JitState, data);
+constexpr int8_t size_offset = offsetof(JitState, size);
+constexpr int8_t capacity_offset = offsetof(JitState, capacity);
+constexpr int8_t need_offset = offsetof(JitState, need);
+
+// the element before data is scratch, so that the top can be loaded and
+// stored without checking for an empty stack
+void grow(JitState *state) {
+  size_t capacity = std::max<size_t>(state->need, state->capacity * 2);
+  state->storage->resize(capacity + 1);
+  state->data = state->storage->data() + 1;
+  state->capacity = capacity;
+}
+
+void roll(JitState *state) {
+  if (state->size < 2) return;
+  int32_t iter = state->data[state->size - 1];
+  int32_t depth = state->data[state->size - 2];
+  if (depth < 0 || state->size - 2 < depth) return;
+  state->size -= 2;
+  if (depth > 0) {
+    int32_t *end = state->data + state->size;
+    std::rotate(end - depth, end - mod(iter, depth), end);
+  }
+}
+
+void in_number(JitState *state) {
+  state->data[state->size++] = io32::getnumber();
+}
+
+void in_char(JitState *state) {
+  state->data[state->size++] = io32::getchar();
+}
+
+void out_number(JitState *state) {
+  if (state->size > 0) io32::putnumber(state->data[--state->size]);
+}
+
+void out_char(JitState *state) {
+  if (state->size > 0) io32::putchar(state->data[--state->size]);
+}
+
+enum Reg : uint8_t { EAX = 0, ECX = 1, EDX = 2 };
+
+enum Cond : uint8_t {
+  Below = 0x2, AboveEqual = 0x3, Equal = 0x4, NotEqual = 0x5,
+  BelowEqual = 0x6, Greater = 0xF
+};
+
+// Register assignment:
+//   rbx: JitState *, r12: stack base, r13: stack size, r14: stack capacity,
+//   r15d: the top of the stack, whose slot in the buffer is stale
+// The top is written back only before helper calls and when something is
+// pushed over it. On an empty stack r15d holds nothing meaningful.
+class Assembler {
+ public:
+  std::vector<uint8_t> buf;
+  void byte(uint8_t b) { buf.push_back(b); }
+  void bytes(std::initializer_list<uint8_t> bs) { buf.insert(buf.end(), bs); }
+  void imm32(int32_t v) {
+    for (int i = 0; i < 4; ++i) byte(static_cast<uint32_t>(v) >> (i * 8));
+  }
+  void imm64(uint64_t v) {
+    for (int i = 0; i < 8; ++i) byte(v >> (i * 8));
+  }
+  // [r12 + r13*4 + disp], rex 0x47 for r15d
+  void slot(uint8_t opcode, uint8_t reg, int32_t disp, uint8_t rex = 0x43) {
+    bytes({rex, opcode});
+    if (-128 <= disp && disp < 128) {
+      bytes({static_cast<uint8_t>(0x44 | reg << 3), 0xAC, static_cast<uint8_t>(disp)});
+    } else {
+      bytes({static_cast<uint8_t>(0x84 | reg << 3), 0xAC});
+      imm32(disp);
+    }
+  }
+  void load(Reg reg, int32_t disp) { slot(0x8B, reg, disp); }
+  void store_imm(int32_t disp, int32_t value) {
+    slot(0xC7, 0, disp);
+    imm32(value);
+  }
+  void load_top() { slot(0x8B, 7, -4, 0x47); }
+  void spill(int32_t disp = -4) { slot(0x89, 7, disp, 0x47); }
+  void set_top(int32_t value) { bytes({0x41, 0xBF}); imm32(value); }
+  void from_top(Reg reg) { bytes({0x44, 0x89, static_cast<uint8_t>(0xF8 | reg)}); }
+  void to_top(Reg reg) { bytes({0x41, 0x89, static_cast<uint8_t>(0xC7 | reg << 3)}); }
+  void inc_size() { bytes({0x49, 0xFF, 0xC5}); }
+  void dec_size() { bytes({0x49, 0xFF, 0xCD}); }
+  void add_size(int32_t n) { bytes({0x49, 0x81, 0xC5}); imm32(n); }
+  void cmp_size(int8_t n) { bytes({0x49, 0x83, 0xFD, static_cast<uint8_t>(n)}); }
+  void test_size() { bytes({0x4D, 0x85, 0xED}); }
+  // returns the position of the rel8 to bind later
+  size_t jcc8(Cond cond) {
+    bytes({static_cast<uint8_t>(0x70 | cond), 0});
+    return buf.size() - 1;
+  }
+  size_t jmp8() {
+    bytes({0xEB, 0});
+    return buf.size() - 1;
+  }
+  void bind8(size_t pos) {
+    const ptrdiff_t rel = buf.size() - (pos + 1);
+    if (rel > 127) throw std::length_error("JIT: short jump out of range");
+    buf[pos] = rel;
+  }
+  // returns the position of the rel32 to patch later
+  size_t jcc32(Cond cond) {
+    bytes({0x0F, static_cast<uint8_t>(0x80 | cond)});
+    imm32(0);
+    return buf.size() - 4;
+  }
+  size_t jmp32() {
+    byte(0xE9);
+    imm32(0);
+    return buf.size() - 4;
+  }
+  void reload() {
+    bytes({0x4C, 0x8B, 0x63, static_cast<uint8_t>(data_offset)});
+    bytes({0x4C, 0x8B, 0x6B, static_cast<uint8_t>(size_offset)});
+    bytes({0x4C, 0x8B, 0x73, static_cast<uint8_t>(capacity_offset)});
+  }
+  void call(void (*fn)(JitState *)) {
+    spill();
+    bytes({0x4C, 0x89, 0x6B, static_cast<uint8_t>(size_offset)}); // mov [rbx+size], r13
+    bytes({0x48, 0x89, 0xDF});                                     // mov rdi, rbx
+    bytes({0x48, 0xB8});                                           // mov rax, fn
+    imm64(reinterpret_cast<uint64_t>(fn));
+    bytes({0xFF, 0xD0});                                           // call rax
+    reload();
+    load_top();
+  }
+  // make room for n more elements
+  void reserve(int32_t n) {
+    bytes({0x49, 0x8D, 0x85}); imm32(n);                           // lea rax, [r13+n]
+    bytes({0x4C, 0x39, 0xF0});                                     // cmp rax, r14
+    size_t ok = jcc8(BelowEqual);
+    bytes({0x48, 0x89, 0x43, static_cast<uint8_t>(need_offset)});  // mov [rbx+need], rax
+    call(grow);
+    bind8(ok);
+  }
+  void prologue() {
+    bytes({0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57});
+    bytes({0x48, 0x89, 0xFB});                                     // mov rbx, rdi
+    reload();
+  }
+  void epilogue() {
+    bytes({0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5B, 0xC3});
+  }
+};
+
+struct Fixup {
+  size_t pos;
+  int32_t block;
+};
+
+// pop the top into eax, or jump to the first successor on an empty stack
+void emit_branch_prefix(Assembler &as, std::vector<Fixup> &fixups, int32_t first) {
+  as.test_size();
+  fixups.push_back(Fixup { as.jcc32(Equal), first });
+  as.from_top(EAX);
+  as.dec_size();
+  as.load_top();
+}
+
+void emit_binary(Assembler &as, std::initializer_list<uint8_t> op) {
+  as.cmp_size(2);
+  size_t skip = as.jcc8(Below);
+  as.from_top(ECX);
+  as.load(EAX, -8);
+  as.bytes(op);
+  as.to_top(EAX);
+  as.dec_size();
+  as.bind8(skip);
+}
+
+void emit_division(Assembler &as, bool modulo) {
+  as.cmp_size(2);
+  size_t skip = as.jcc8(Below);
+  as.from_top(ECX);
+  as.load(EAX, -8);
+  as.bytes({0x85, 0xC9});                                          // test ecx, ecx
+  size_t zero = as.jcc8(Equal);
+  // idiv traps on INT_MIN / -1, so -1 is handled without it
+  as.bytes({0x83, 0xF9, 0xFF});                                    // cmp ecx, -1
+  size_t general = as.jcc8(NotEqual);
+  if (modulo) {
+    as.bytes({0x31, 0xC0});                                        // xor eax, eax
+  } else {
+    as.bytes({0xF7, 0xD8});                                        // neg eax
+  }
+  size_t done = as.jmp8();
+  as.bind8(general);
+  as.bytes({0x99, 0xF7, 0xF9});                                    // cdq; idiv ecx
+  if (modulo) as.bytes({0x89, 0xD0});                              // mov eax, edx
+  as.bind8(done);
+  as.to_top(EAX);
+  as.dec_size();
+  as.bind8(zero);
+  as.bind8(skip);
+}
+
+// top = top op value, or push value on an empty stack
+void emit_immediate(Assembler &as, std::initializer_list<uint8_t> op, int32_t value) {
+  as.test_size();
+  size_t empty = as.jcc8(Equal);
+  as.bytes(op);
+  as.imm32(value);
+  size_t done = as.jmp8();
+  as.bind8(empty);
+  as.reserve(1);
+  as.set_top(value);
+  as.inc_size();
+  as.bind8(done);
+}
+
+// top = top == 0 or top != 0, harmless on an empty stack
+void emit_test(Assembler &as, Cond cond) {
+  as.bytes({0x45, 0x85, 0xFF});                                    // test r15d, r15d
+  as.bytes({0x0F, static_cast<uint8_t>(0x90 | cond), 0xC0});       // setcc al
+  as.bytes({0x44, 0x0F, 0xB6, 0xF8});                              // movzx r15d, al
+}
+
+void emit_command(Assembler &as, const Command &cmd) {
+  switch (cmd.command_type()) {
+    case ConcreteCommandType::Nop:
+      break;
+    case ConcreteCommandType::Push:
+      as.reserve(1);
+      as.spill();
+      as.set_top(dynamic_cast<const Push &>(cmd).get_value());
+      as.inc_size();
+      break;
+    case ConcreteCommandType::PushArray:
+      {
+        const auto &data = dynamic_cast<const PushArray &>(cmd).get_data();
+        as.reserve(data.size());
+        as.spill();
+        for (size_t i = 0; i + 1 < data.size(); ++i) {
+          as.store_imm(i * 4, data[i]);
+        }
+        as.set_top(data.back());
+        as.add_size(data.size());
+      }
+      break;
+    case ConcreteCommandType::Duplicate:
+      {
+        as.test_size();
+        size_t skip = as.jcc8(Equal);
+        as.reserve(1);
+        as.spill();
+        as.inc_size();
+        as.bind8(skip);
+      }
+      break;
+    case ConcreteCommandType::Pop:
+      as.bytes({0x49, 0x81, 0xED});                                // sub r13, count
+      as.imm32(dynamic_cast<const Pop &>(cmd).get_count());
+      {
+        size_t ok = as.jcc8(AboveEqual);
+        as.bytes({0x45, 0x31, 0xED});                              // xor r13d, r13d
+        as.bind8(ok);
+      }
+      as.load_top();
+      break;
+    case ConcreteCommandType::InNumber:
+      as.reserve(1);
+      as.call(in_number);
+      break;
+    case ConcreteCommandType::InChar:
+      as.reserve(1);
+      as.call(in_char);
+      break;
+    case ConcreteCommandType::OutNumber:
+      as.call(out_number);
+      break;
+    case ConcreteCommandType::OutChar:
+      as.call(out_char);
+      break;
+    case ConcreteCommandType::Add:
+      emit_binary(as, {0x01, 0xC8});                               // add eax, ecx
+      break;
+    case ConcreteCommandType::Subtract:
+      emit_binary(as, {0x29, 0xC8});                               // sub eax, ecx
+      break;
+    case ConcreteCommandType::Multiply:
+      emit_binary(as, {0x0F, 0xAF, 0xC1});                         // imul eax, ecx
+      break;
+    case ConcreteCommandType::Greater:
+      // xor edx, edx; cmp eax, ecx; setg dl; mov eax, edx
+      emit_binary(as, {0x31, 0xD2, 0x39, 0xC8, 0x0F, 0x9F, 0xC2, 0x89, 0xD0});
+      break;
+    case ConcreteCommandType::Divide:
+      emit_division(as, false);
+      break;
+    case ConcreteCommandType::Modulo:
+      emit_division(as, true);
+      break;
+    case ConcreteCommandType::Not:
+      emit_test(as, Equal);
+      break;
+    case ConcreteCommandType::Swap:
+      {
+        as.cmp_size(2);
+        size_t skip = as.jcc8(Below);
+        as.load(EAX, -8);
+        as.spill(-8);
+        as.to_top(EAX);
+        as.bind8(skip);
+      }
+      break;
+    case ConcreteCommandType::Roll:
+      as.call(roll);
+      break;
+    case ConcreteCommandType::AddImm:
+      emit_immediate(as, {0x41, 0x81, 0xC7}, dynamic_cast<const AddImm &>(cmd).get_value()); // add r15d, imm
+      break;
+    case ConcreteCommandType::SubImm:
+      emit_immediate(as, {0x41, 0x81, 0xEF}, dynamic_cast<const SubImm &>(cmd).get_value()); // sub r15d, imm
+      break;
+    case ConcreteCommandType::MulImm:
+      emit_immediate(as, {0x45, 0x69, 0xFF}, dynamic_cast<const MulImm &>(cmd).get_value()); // imul r15d, r15d, imm
+      break;
+    case ConcreteCommandType::NotNot:
+      emit_test(as, NotEqual);
+      break;
+    case ConcreteCommandType::RollConst:
+      {
+        const auto &roll_const = dynamic_cast<const RollConst &>(cmd);
+        as.reserve(2);
+        as.spill();
+        as.store_imm(0, roll_const.get_depth());
+        as.set_top(roll_const.get_iter());
+        as.add_size(2);
+        as.call(roll);
+      }
+      break;
+    default: throw std::domain_error("JIT: unexpected command");
+  }
+}
+
+} // namespace
+
+Jit::Jit(const BasicBlockGraph &bbg) : code(nullptr), size(0) {
+#if !defined(__x86_64__)
+  throw std::runtime_error("JIT is only available on x86-64");
+#endif
+  Assembler as;
+  std::vector<size_t> block_offset(bbg.size());
+  std::vector<Fixup> fixups;
+  as.prologue();
+  for (size_t i = 0; i < bbg.size(); ++i) {
+    block_offset[i] = as.buf.size();
+    const auto &commands = bbg[i].get_commands();
+    const auto &next_index = bbg[i].get_next_index();
+    auto jump = [&](int32_t target) {
+      if (target != static_cast<int32_t>(i + 1)) {
+        fixups.push_back(Fixup { as.jmp32(), target });
+      }
+    };
+    for (const auto &cmd : commands) {
+      switch (cmd->command_type()) {
+        case ConcreteCommandType::Jez:
+          emit_branch_prefix(as, fixups, next_index.at(0));
+          as.bytes({0x85, 0xC0});                                  // test eax, eax
+          fixups.push_back(Fixup { as.jcc32(Equal), next_index.at(1) });
+          jump(next_index.at(0));
+          break;
+        case ConcreteCommandType::DupBranchZero:
+          as.test_size();
+          fixups.push_back(Fixup { as.jcc32(Equal), next_index.at(0) });
+          as.bytes({0x45, 0x85, 0xFF});                            // test r15d, r15d
+          fixups.push_back(Fixup { as.jcc32(Equal), next_index.at(1) });
+          jump(next_index.at(0));
+          break;
+        case ConcreteCommandType::Switch:
+          emit_branch_prefix(as, fixups, next_index.at(0));
+          as.bytes({0xA8, 0x01});                                  // test al, 1
+          fixups.push_back(Fixup { as.jcc32(NotEqual), next_index.at(1) });
+          jump(next_index.at(0));
+          break;
+        case ConcreteCommandType::Pointer:
+          emit_branch_prefix(as, fixups, next_index.at(0));
+          as.bytes({0x83, 0xE0, 0x03});                            // and eax, 3
+          fixups.push_back(Fixup { as.jcc32(Equal), next_index.at(0) });
+          for (uint8_t j = 1; j < 3; ++j) {
+            as.bytes({0x83, 0xF8, j});                             // cmp eax, j
+            fixups.push_back(Fixup { as.jcc32(Equal), next_index.at(j) });
+          }
+          jump(next_index.at(3));
+          break;
+        case ConcreteCommandType::Halt:
+          as.epilogue();
+          break;
+        default:
+          emit_command(as, *cmd);
+      }
+    }
+    switch (commands.back()->command_type()) {
+      case ConcreteCommandType::Jez:
+      case ConcreteCommandType::DupBranchZero:
+      case ConcreteCommandType::Switch:
+      case ConcreteCommandType::Pointer:
+      case ConcreteCommandType::Halt:
+        break;
+      default:
+        if (next_index.empty()) {
+          as.epilogue();
+        } else {
+          jump(next_index.front());
+        }
+    }
+  }
+  for (const auto &fixup : fixups) {
+    int32_t rel = block_offset[fixup.block] - (fixup.pos + 4);
+    std::memcpy(&as.buf[fixup.pos], &rel, 4);
+  }
+  size = as.buf.size();
+  code = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (code == MAP_FAILED) {
+    code = nullptr;
+    throw std::runtime_error("JIT: cannot allocate code memory");
+  }
+  std::memcpy(code, as.buf.data(), size);
+  if (mprotect(code, size, PROT_READ | PROT_EXEC) != 0) {
+    munmap(code, size);
+    code = nullptr;
+    throw std::runtime_error("JIT: cannot make code executable");
+  }
+}
+
+Jit::~Jit() {
+  if (code) munmap(code, size);
+}
+
+void Jit::exec() const {
+  std::vector<int32_t> storage(1025);
+  JitState state { storage.data() + 1, 0, static_cast<int64_t>(storage.size() - 1), 0, &storage };
+  reinterpret_cast<void (*)(JitState *)>(code)(&state);
+}
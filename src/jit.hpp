@@ -0,0 +1,23 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "basic_blocks.hpp"
+
+// Native code for a whole BasicBlockGraph, x86-64 only.
+// The stack lives in a growable buffer whose base, size and capacity stay in
+// callee-saved registers, and its top is kept in a register of its own;
+// commands that need the C++ runtime (I/O, Roll, growth) call back into
+// small helpers.
+class Jit {
+ public:
+  explicit Jit(const BasicBlockGraph &bbg);
+  Jit(const Jit &) = delete;
+  Jit &operator=(const Jit &) = delete;
+  ~Jit();
+  void exec() const;
+  size_t code_size() const { return size; }
+ private:
+  void *code;
+  size_t size;
+};
@@ -1,25 +1,148 @@
 #include <fstream>
 #include <iostream>
+#include <string>
+#include <vector>
 #include "visualize.hpp"
 #include "interpret.hpp"
 #include "color_blocks.hpp"
 #include "basic_blocks.hpp"
+#include "bytecode.hpp"
+#include "jit.hpp"
+#include "ssa.hpp"
+#include "trace.hpp"
 
 int main(int argc, char* argv[]) {
-  if (argc < 3) {
-    std::cerr << "usage: " << argv[0] << " [PNG FILENAME] [CODEL SIZE]" << std::endl;
+  std::string mode = "cpp";
+  std::string fusion = "all";
+  bool fusion_stats = false;
+  bool fold = true;
+  bool fold_stats = false;
+  bool trace_stats = false;
+  bool depth_stats = false;
+  bool lazy = false;
+  bool reach_stats = false;
+  bool minimize = false;
+  bool minimize_stats = false;
+  GridLayout layout = GridLayout::rows;
+  std::vector<std::string> args;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg.compare(0, 7, "--mode=") == 0) {
+      mode = arg.substr(7);
+    } else if (arg.compare(0, 7, "--fuse=") == 0) {
+      fusion = arg.substr(7);
+    } else if (arg == "--fusion-stats") {
+      fusion_stats = true;
+    } else if (arg == "--no-fold") {
+      fold = false;
+    } else if (arg == "--fold-stats") {
+      fold_stats = true;
+    } else if (arg == "--trace-stats") {
+      trace_stats = true;
+    } else if (arg == "--depth-stats") {
+      depth_stats = true;
+    } else if (arg == "--lazy") {
+      lazy = true;
+    } else if (arg == "--reach-stats") {
+      reach_stats = true;
+    } else if (arg == "--minimize") {
+      minimize = true;
+    } else if (arg == "--minimize-stats") {
+      minimize_stats = true;
+    } else if (arg == "--layout=rows") {
+      layout = GridLayout::rows;
+    } else if (arg == "--layout=tiles") {
+      layout = GridLayout::tiles;
+    } else {
+      args.push_back(arg);
+    }
+  }
+  if (args.empty()) {
+    std::cerr << "usage: " << argv[0] << " [--mode=cpp|ssa-cpp|graph|block|ssa|bytecode|trace|jit] [--fuse=all|none|PATTERNS] [--fusion-stats] [--no-fold] [--fold-stats] [--trace-stats] [--depth-stats] [--lazy] [--reach-stats] [--minimize] [--minimize-stats] [--layout=rows|tiles] [PNG FILENAME] [CODEL SIZE]" << std::endl;
+    std::cerr << "  CODEL SIZE is detected when omitted" << std::endl;
     return EXIT_FAILURE;
   }
   try {
-    Image image(argv[1]);
-    CodelTable table(image, std::stoi(argv[2]));
-    ColorBlockGraph graph(table);
+    const auto fusions = parse_fusions(fusion);
+    CodelTable table(args[0], args.size() > 1 ? std::stoi(args[1]) : 0, layout);
+    if (table.uniform_size() % table.codel_size() != 0) {
+      std::cerr << "warning: codels of size " << table.codel_size() << " are not uniform, the image looks like codel size " << table.uniform_size() << std::endl;
+    }
+    ColorBlockGraph graph(table, lazy);
+    if (reach_stats) {
+      size_t colored = 0;
+      for (size_t y = 0; y < table.height(); ++y) {
+        const auto row = table[y];
+        for (size_t x = 0; x < table.width(); ++x) colored += is_color(row[x]);
+      }
+      const size_t skipped = colored - graph.labeled_count();
+      std::cerr << "reach: " << graph.size() << " blocks, " << skipped << " of " << colored
+        << " colour codels skipped (" << (colored ? 100.0 * skipped / colored : 0.0) << "%)" << std::endl;
+    }
     CommandGraph cg(graph);
+    if (minimize) {
+      const size_t before = cg.size();
+      cg.minimize();
+      if (minimize_stats) {
+        std::cerr << "minimize: " << before << " -> " << cg.size() << " command nodes" << std::endl;
+      }
+    }
+    if (mode == "graph") {
+      cg.exec();
+      return 0;
+    }
     BasicBlockGraph bbg(cg);
-    std::cerr << "Compile Completed" << std::endl;
-    std::cout << bbg << std::flush;
+    if (fold) {
+      const size_t before = bbg.command_count();
+      bbg.fold();
+      if (fold_stats) {
+        std::cerr << "fold: " << before << " -> " << bbg.command_count() << " commands" << std::endl;
+      }
+    }
+    if (fusion_stats) {
+      for (const auto &[count, first, second] : bbg.pair_frequency()) {
+        std::cerr << count << "\t" << command_name(first) << " " << command_name(second) << std::endl;
+      }
+    }
+    bbg.fuse(fusions);
+    bbg.analyze_depth();
+    if (depth_stats) {
+      std::cerr << "depth: " << bbg.unchecked_count() << " of " << bbg.command_count() << " commands unchecked, max depth ";
+      if (bbg.max_depth() < 0) {
+        std::cerr << "unbounded" << std::endl;
+      } else {
+        std::cerr << bbg.max_depth() << std::endl;
+      }
+    }
+    if (mode == "block") {
+      bbg.exec();
+    } else if (mode == "bytecode") {
+      Bytecode(bbg).exec();
+    } else if (mode == "trace") {
+      Tracer tracer(bbg);
+      tracer.exec();
+      if (trace_stats) {
+        std::cerr << "trace: " << tracer.trace_count() << " traces, " << tracer.side_exit_count() << " side exits" << std::endl;
+      }
+    } else if (mode == "jit") {
+      Jit(bbg).exec();
+    } else if (mode == "ssa") {
+      SsaGraph(bbg).exec();
+    } else if (mode == "ssa-cpp") {
+      std::cerr << "Compile Completed" << std::endl;
+      std::cout << SsaGraph(bbg) << std::flush;
+    } else if (mode == "cpp") {
+      std::cerr << "Compile Completed" << std::endl;
+      std::cout << bbg << std::flush;
+    } else {
+      std::cerr << "unknown mode: " << mode << std::endl;
+      return EXIT_FAILURE;
+    }
   } catch (png::error& e) {
     std::cerr << e.what() << std::endl;
+  } catch (std::invalid_argument& e) {
+    std::cerr << e.what() << std::endl;
+    return EXIT_FAILURE;
   }
   return 0;
 }
@@ -1,4 +1,5 @@
 #include "parser.hpp"
+#include <array>
 
 Hue what_hue(const Pixel &pixel) {
   const byte r = pixel.red, g = pixel.green, b = pixel.blue;
@@ -66,10 +67,10 @@ CodelsTable normalize(const Image &image, const std::size_t codel_size) {
   //if (codel_size == 0) codel_size = detect_codel_size(image);
   const std::size_t height = image.get_height();
   const std::size_t width = image.get_width();
-  CodelsTable codels_table(height, width);
+  CodelsTable codels_table(width, height);
   for (std::size_t i = 0; i < height; ++i) {
     for (std::size_t j = 0; j < width; ++j) {
-      codels_table.set(i, j, what_color(image[i*codel_size][j*codel_size]));
+      codels_table[i][j] = to_codel(what_color(image[i*codel_size][j*codel_size]));
     }
   }
   return codels_table;
@@ -120,8 +121,18 @@ CommandType colorDiff2CommandType(const Color &now, const Color &next) {
   return static_cast<CommandType>(huediff * 3 + brightnessdiff);
 }
 
-CommandType color_to_command(const Color from, const Color to) {
-  return colorDiff2CommandType(from, to);
+CommandType color_to_command(const Codel from, const Codel to) {
+  using Row = std::array<CommandType, codel_kinds>;
+  static const std::array<Row, codel_kinds> table = [] {
+    std::array<Row, codel_kinds> res;
+    for (Codel i = 0; i < codel_kinds; ++i) {
+      for (Codel j = 0; j < codel_kinds; ++j) {
+        res[i][j] = colorDiff2CommandType(to_color(i), to_color(j));
+      }
+    }
+    return res;
+  }();
+  return table[from][to];
 }
 
 // using Pos = std::tuple<int64_t, int64_t>;
@@ -24,4 +24,4 @@ enum class CommandType {
 };
 
 CodelsTable normalize(const Image &image, const std::size_t codel_size = 0);
-CommandType color_to_command(const Color from, const Color to);
+CommandType color_to_command(const Codel from, const Codel to);
@@ -0,0 +1,432 @@
+#include "ssa.hpp"
+#include <algorithm>
+#include <stdexcept>
+#include "io32.hpp"
+
+namespace {
+
+// Rolls deeper than this stay on the real stack
+constexpr int32_t max_register_roll = 64;
+
+int32_t wrap(int64_t value) {
+  return static_cast<int32_t>(static_cast<uint32_t>(value));
+}
+
+class SegmentBuilder {
+ public:
+  SegmentBuilder() : sources(), stack(), consumed(0), seg() {}
+  // false if cmd has no static stack effect; nothing is changed then
+  bool apply(const Command &cmd);
+  int32_t pop() {
+    if (stack.empty()) return fresh(SsaOp::Load, consumed++, false);
+    int32_t reg = stack.back();
+    stack.pop_back();
+    return reg;
+  }
+  void push(int32_t reg) { stack.push_back(reg); }
+  // registers are defined on first use, so unused constants and loads cost nothing
+  int32_t use(int32_t reg) {
+    auto &source = sources[reg];
+    if (!source.emitted) {
+      seg.code.push_back(SsaInstruction { source.op, reg, source.value, 0 });
+      source.emitted = true;
+    }
+    return reg;
+  }
+  SsaSegment finish(const std::shared_ptr<Command> &barrier) {
+    // a bottom run of untouched inputs stays where it is
+    size_t keep = 0;
+    while (keep < stack.size()) {
+      const auto &source = sources[stack[keep]];
+      if (source.op != SsaOp::Load || source.value != consumed - 1 - static_cast<int32_t>(keep)) break;
+      ++keep;
+    }
+    seg.need = consumed;
+    seg.drop = consumed - keep;
+    for (size_t i = keep; i < stack.size(); ++i) {
+      seg.outputs.push_back(use(stack[i]));
+    }
+    seg.barrier = barrier;
+    return std::move(seg);
+  }
+  int32_t register_count() const { return sources.size(); }
+  SsaSegment &segment() { return seg; }
+ private:
+  struct Source {
+    SsaOp op;
+    int32_t value;
+    bool emitted;
+  };
+  int32_t fresh(SsaOp op, int32_t value, bool emitted) {
+    sources.push_back(Source { op, value, emitted });
+    return sources.size() - 1;
+  }
+  int32_t constant(int32_t value) { return fresh(SsaOp::Const, value, false); }
+  bool known(int32_t reg) const { return sources[reg].op == SsaOp::Const; }
+  int32_t value(int32_t reg) const { return sources[reg].value; }
+  bool top_known(size_t depth) const {
+    return depth < stack.size() && known(stack[stack.size() - 1 - depth]);
+  }
+  int32_t def(SsaOp op, int32_t lhs = 0, int32_t rhs = 0) {
+    int32_t reg = fresh(op, 0, true);
+    seg.code.push_back(SsaInstruction { op, reg, lhs, rhs });
+    return reg;
+  }
+  void binary(SsaOp op, int32_t lhs, int32_t rhs);
+  bool roll(int32_t depth, int32_t iter);
+  std::vector<Source> sources;
+  std::vector<int32_t> stack;
+  int32_t consumed;
+  SsaSegment seg;
+};
+
+void SegmentBuilder::binary(SsaOp op, int32_t lhs, int32_t rhs) {
+  if (!known(lhs) || !known(rhs)) {
+    push(def(op, use(lhs), use(rhs)));
+    return;
+  }
+  const int64_t l = value(lhs), r = value(rhs);
+  switch (op) {
+    case SsaOp::Add: push(constant(wrap(l + r))); break;
+    case SsaOp::Subtract: push(constant(wrap(l - r))); break;
+    case SsaOp::Multiply: push(constant(wrap(l * r))); break;
+    case SsaOp::Divide: push(constant(wrap(l / r))); break;
+    case SsaOp::Modulo: push(constant(wrap(l % r))); break;
+    case SsaOp::Greater: push(constant(l > r ? 1 : 0)); break;
+    default: throw std::domain_error("not a binary SsaOp");
+  }
+}
+
+bool SegmentBuilder::roll(int32_t depth, int32_t iter) {
+  if (depth > max_register_roll) return false;
+  if (depth < 0) {
+    push(constant(depth));
+    push(constant(iter));
+  } else if (depth > 0) {
+    std::vector<int32_t> window(depth);
+    for (int32_t i = depth - 1; i >= 0; --i) window[i] = pop();
+    std::rotate(std::begin(window), std::end(window) - mod(iter, depth), std::end(window));
+    for (int32_t reg : window) push(reg);
+  }
+  return true;
+}
+
+bool SegmentBuilder::apply(const Command &cmd) {
+  switch (cmd.command_type()) {
+    case ConcreteCommandType::Nop:
+      break;
+    case ConcreteCommandType::Push:
+      push(constant(dynamic_cast<const Push &>(cmd).get_value()));
+      break;
+    case ConcreteCommandType::PushArray:
+      for (int32_t value : dynamic_cast<const PushArray &>(cmd).get_data()) {
+        push(constant(value));
+      }
+      break;
+    case ConcreteCommandType::Pop:
+      for (int32_t i = 0; i < dynamic_cast<const Pop &>(cmd).get_count(); ++i) pop();
+      break;
+    case ConcreteCommandType::Duplicate:
+      {
+        int32_t reg = pop();
+        push(reg);
+        push(reg);
+      }
+      break;
+    case ConcreteCommandType::InNumber:
+      push(def(SsaOp::InNumber));
+      break;
+    case ConcreteCommandType::InChar:
+      push(def(SsaOp::InChar));
+      break;
+    case ConcreteCommandType::OutNumber:
+      seg.code.push_back(SsaInstruction { SsaOp::OutNumber, 0, use(pop()), 0 });
+      break;
+    case ConcreteCommandType::OutChar:
+      seg.code.push_back(SsaInstruction { SsaOp::OutChar, 0, use(pop()), 0 });
+      break;
+    case ConcreteCommandType::Add:
+    case ConcreteCommandType::Subtract:
+    case ConcreteCommandType::Multiply:
+    case ConcreteCommandType::Greater:
+      {
+        int32_t rhs = pop();
+        int32_t lhs = pop();
+        switch (cmd.command_type()) {
+          case ConcreteCommandType::Add: binary(SsaOp::Add, lhs, rhs); break;
+          case ConcreteCommandType::Subtract: binary(SsaOp::Subtract, lhs, rhs); break;
+          case ConcreteCommandType::Multiply: binary(SsaOp::Multiply, lhs, rhs); break;
+          default: binary(SsaOp::Greater, lhs, rhs);
+        }
+      }
+      break;
+    case ConcreteCommandType::Divide:
+    case ConcreteCommandType::Modulo:
+      // whether the command is ignored depends on the divisor
+      if (!top_known(0)) return false;
+      if (value(stack.back()) != 0) {
+        int32_t rhs = pop();
+        int32_t lhs = pop();
+        binary(cmd.command_type() == ConcreteCommandType::Divide ? SsaOp::Divide : SsaOp::Modulo, lhs, rhs);
+      }
+      break;
+    case ConcreteCommandType::Not:
+    case ConcreteCommandType::NotNot:
+      {
+        int32_t reg = pop();
+        bool negate = cmd.command_type() == ConcreteCommandType::Not;
+        if (known(reg)) {
+          push(constant((value(reg) != 0) != negate ? 1 : 0));
+        } else {
+          push(def(negate ? SsaOp::Not : SsaOp::Bool, use(reg)));
+        }
+      }
+      break;
+    case ConcreteCommandType::Swap:
+      {
+        int32_t rhs = pop();
+        int32_t lhs = pop();
+        push(rhs);
+        push(lhs);
+      }
+      break;
+    case ConcreteCommandType::Roll:
+      {
+        if (!top_known(0) || !top_known(1)) return false;
+        int32_t iter = value(stack[stack.size() - 1]);
+        int32_t depth = value(stack[stack.size() - 2]);
+        if (depth > max_register_roll) return false;
+        stack.resize(stack.size() - 2);
+        roll(depth, iter);
+      }
+      break;
+    case ConcreteCommandType::RollConst:
+      {
+        const auto &roll_const = dynamic_cast<const RollConst &>(cmd);
+        return roll(roll_const.get_depth(), roll_const.get_iter());
+      }
+    case ConcreteCommandType::AddImm:
+      binary(SsaOp::Add, pop(), constant(dynamic_cast<const AddImm &>(cmd).get_value()));
+      break;
+    case ConcreteCommandType::SubImm:
+      binary(SsaOp::Subtract, pop(), constant(dynamic_cast<const SubImm &>(cmd).get_value()));
+      break;
+    case ConcreteCommandType::MulImm:
+      binary(SsaOp::Multiply, pop(), constant(dynamic_cast<const MulImm &>(cmd).get_value()));
+      break;
+    default:
+      return false;
+  }
+  return true;
+}
+
+void run(const SsaSegment &seg, std::vector<int32_t> &regs, Stack &stack) {
+  for (const auto &ins : seg.code) {
+    switch (ins.op) {
+      case SsaOp::Const: regs[ins.dst] = ins.lhs; break;
+      case SsaOp::Load: regs[ins.dst] = stack.peek(ins.lhs); break;
+      case SsaOp::Add: regs[ins.dst] = regs[ins.lhs] + regs[ins.rhs]; break;
+      case SsaOp::Subtract: regs[ins.dst] = regs[ins.lhs] - regs[ins.rhs]; break;
+      case SsaOp::Multiply: regs[ins.dst] = regs[ins.lhs] * regs[ins.rhs]; break;
+      case SsaOp::Divide: regs[ins.dst] = regs[ins.lhs] / regs[ins.rhs]; break;
+      case SsaOp::Modulo: regs[ins.dst] = regs[ins.lhs] % regs[ins.rhs]; break;
+      case SsaOp::Greater: regs[ins.dst] = regs[ins.lhs] > regs[ins.rhs] ? 1 : 0; break;
+      case SsaOp::Not: regs[ins.dst] = regs[ins.lhs] ? 0 : 1; break;
+      case SsaOp::Bool: regs[ins.dst] = regs[ins.lhs] ? 1 : 0; break;
+      case SsaOp::InNumber: regs[ins.dst] = io32::getnumber(); break;
+      case SsaOp::InChar: regs[ins.dst] = io32::getchar(); break;
+      case SsaOp::OutNumber: io32::putnumber(regs[ins.lhs]); break;
+      case SsaOp::OutChar: io32::putchar(regs[ins.lhs]); break;
+    }
+  }
+  stack.drop(seg.drop);
+  for (int32_t reg : seg.outputs) stack.push(regs[reg]);
+}
+
+// fast: the last segment ran in registers, so cond is valid
+int32_t next_block(const SsaBlock &block, bool fast, const std::vector<int32_t> &regs, Stack &stack) {
+  if (block.exit == SsaExit::Jump) return block.next_index.front();
+  if (block.exit == SsaExit::Halt) return -1;
+  int32_t value;
+  if (fast) {
+    value = regs[block.cond];
+  } else if (!stack.empty()) {
+    value = stack.top();
+    if (block.exit != SsaExit::DupBranchZero) stack.pop();
+  } else {
+    return block.next_index.front();
+  }
+  switch (block.exit) {
+    case SsaExit::Jez:
+    case SsaExit::DupBranchZero:
+      return block.next_index[value == 0 ? 1 : 0];
+    case SsaExit::Switch:
+      return block.next_index[mod(value, 2)];
+    default:
+      return block.next_index[mod(value, 4)];
+  }
+}
+
+std::string reg_name(int32_t reg) {
+  return "r" + std::to_string(reg);
+}
+
+std::string to_cpp_string(const SsaInstruction &ins) {
+  const std::string dst = "    const int32_t " + reg_name(ins.dst) + " = ";
+  const std::string lhs = reg_name(ins.lhs), rhs = reg_name(ins.rhs);
+  switch (ins.op) {
+    case SsaOp::Const: return dst + std::to_string(ins.lhs) + ";\n";
+    case SsaOp::Load: return dst + "stack.peek(" + std::to_string(ins.lhs) + ");\n";
+    case SsaOp::Add: return dst + lhs + " + " + rhs + ";\n";
+    case SsaOp::Subtract: return dst + lhs + " - " + rhs + ";\n";
+    case SsaOp::Multiply: return dst + lhs + " * " + rhs + ";\n";
+    case SsaOp::Divide: return dst + lhs + " / " + rhs + ";\n";
+    case SsaOp::Modulo: return dst + lhs + " % " + rhs + ";\n";
+    case SsaOp::Greater: return dst + lhs + " > " + rhs + " ? 1 : 0;\n";
+    case SsaOp::Not: return dst + lhs + " ? 0 : 1;\n";
+    case SsaOp::Bool: return dst + lhs + " ? 1 : 0;\n";
+    case SsaOp::InNumber: return dst + "get_number();\n";
+    case SsaOp::InChar: return dst + "get_char();\n";
+    case SsaOp::OutNumber: return "    put_number(" + lhs + ");\n";
+    case SsaOp::OutChar: return "    put_char(" + lhs + ");\n";
+  }
+  throw std::domain_error("Unknown SsaOp");
+}
+
+} // namespace
+
+SsaGraph::SsaGraph(const BasicBlockGraph &bbg) : blocks(), register_count(0) {
+  blocks.reserve(bbg.size());
+  for (size_t i = 0; i < bbg.size(); ++i) {
+    const auto &commands = bbg[i].get_commands();
+    SsaBlock block { {}, SsaExit::Jump, -1, bbg[i].get_next_index() };
+    SegmentBuilder builder;
+    auto flush = [&](const std::shared_ptr<Command> &barrier) {
+      register_count = std::max(register_count, builder.register_count());
+      block.segments.push_back(builder.finish(barrier));
+      builder = SegmentBuilder();
+    };
+    for (const auto &cmd : commands) {
+      switch (cmd->command_type()) {
+        case ConcreteCommandType::Halt:
+          block.exit = SsaExit::Halt;
+          break;
+        case ConcreteCommandType::Jez:
+          block.exit = SsaExit::Jez;
+          block.cond = builder.use(builder.pop());
+          break;
+        case ConcreteCommandType::Switch:
+          block.exit = SsaExit::Switch;
+          block.cond = builder.use(builder.pop());
+          break;
+        case ConcreteCommandType::Pointer:
+          block.exit = SsaExit::Pointer;
+          block.cond = builder.use(builder.pop());
+          break;
+        case ConcreteCommandType::DupBranchZero:
+          block.exit = SsaExit::DupBranchZero;
+          block.cond = builder.use(builder.pop());
+          builder.push(block.cond);
+          break;
+        default:
+          if (builder.apply(*cmd)) {
+            builder.segment().fallback.push_back(cmd);
+          } else {
+            flush(cmd);
+          }
+      }
+    }
+    flush(nullptr);
+    if (block.exit == SsaExit::Jump && block.next_index.empty()) {
+      block.exit = SsaExit::Halt;
+    }
+    blocks.push_back(std::move(block));
+  }
+}
+
+void SsaGraph::exec() const {
+  Stack stack;
+  std::vector<int32_t> regs(register_count);
+  int32_t index = 0;
+  while (index >= 0) {
+    const SsaBlock &block = blocks[index];
+    bool fast = false;
+    for (const auto &seg : block.segments) {
+      fast = stack.size() >= static_cast<size_t>(seg.need);
+      if (fast) {
+        run(seg, regs, stack);
+      } else {
+        for (const auto &cmd : seg.fallback) cmd->exec(stack);
+      }
+      if (seg.barrier) seg.barrier->exec(stack);
+    }
+    index = next_block(block, fast, regs, stack);
+  }
+}
+
+std::ostream& operator<<(std::ostream &os, const SsaGraph &ssa) {
+  os << "#include <cstdlib>\n";
+  os << "#include \"lib/stack.hpp\"\n";
+  os << "int main() {\n";
+  os << "  Stack stack;\n";
+  for (size_t i = 0; i < ssa.blocks.size(); ++i) {
+    const auto &block = ssa.blocks[i];
+    const bool branch = block.exit != SsaExit::Jump && block.exit != SsaExit::Halt;
+    os << "  label" << i << ":\n";
+    os << "  {\n";
+    if (branch) os << "  int32_t cond;\n";
+    for (size_t j = 0; j < block.segments.size(); ++j) {
+      const auto &seg = block.segments[j];
+      const bool last = j == block.segments.size() - 1;
+      os << "  if (stack.size() >= " << seg.need << ") {\n";
+      for (const auto &ins : seg.code) os << to_cpp_string(ins);
+      if (seg.drop) os << "    stack.drop(" << seg.drop << ");\n";
+      for (int32_t reg : seg.outputs) os << "    stack.push(" << reg_name(reg) << ");\n";
+      if (branch && last) {
+        switch (block.exit) {
+          case SsaExit::Jez:
+          case SsaExit::DupBranchZero:
+            os << "    cond = " << reg_name(block.cond) << " == 0;\n";
+            break;
+          case SsaExit::Switch:
+            os << "    cond = mod(" << reg_name(block.cond) << ", 2);\n";
+            break;
+          default:
+            os << "    cond = mod(" << reg_name(block.cond) << ", 4);\n";
+        }
+      }
+      os << "  } else {\n";
+      for (const auto &cmd : seg.fallback) os << cmd->to_cpp_string();
+      if (branch && last) {
+        switch (block.exit) {
+          case SsaExit::Jez: os << "  cond = stack.eq_zero();\n"; break;
+          case SsaExit::DupBranchZero: os << "  cond = stack.dup_eq_zero();\n"; break;
+          case SsaExit::Switch: os << "  cond = stack.switch_();\n"; break;
+          default: os << "  cond = stack.pointer();\n";
+        }
+      }
+      os << "  }\n";
+      if (seg.barrier) os << seg.barrier->to_cpp_string();
+    }
+    if (block.exit == SsaExit::Halt) {
+      os << "  exit(0);\n";
+    } else if (block.exit == SsaExit::Jump) {
+      os << "  goto label" << block.next_index.front() << ";\n";
+    } else {
+      os << "  switch(cond) {\n";
+      for (size_t j = 0; j < block.next_index.size(); ++j) {
+        if (j != block.next_index.size() - 1) {
+          os << "    case " << j << ":\n";
+        } else {
+          os << "    default:\n";
+        }
+        os << "      goto label" << block.next_index[j] << ";\n";
+      }
+      os << "  }\n";
+    }
+    os << "  }\n";
+  }
+  os << "  return 0;\n";
+  os << "}";
+  return os;
+}
@@ -0,0 +1,75 @@
+#pragma once
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <vector>
+#include "basic_blocks.hpp"
+
+// Register form of a BasicBlockGraph.
+//
+// Each block is cut into segments at commands whose stack effect is not
+// known statically (Roll with non-constant operands, Divide/Modulo by a
+// non-constant). Inside a segment stack slots are virtual registers: the
+// segment reads its inputs from the top `need` elements, and the real stack
+// is only touched once at the end. When fewer than `need` elements are
+// present some command would underflow, so the original commands run instead.
+
+enum class SsaOp : uint8_t {
+  Const,      // dst = lhs
+  Load,       // dst = lhs-th element from the top at segment entry
+  Add,
+  Subtract,
+  Multiply,
+  Divide,
+  Modulo,
+  Greater,
+  Not,
+  Bool,       // dst = lhs != 0
+  InNumber,
+  InChar,
+  OutNumber,  // output lhs
+  OutChar
+};
+
+struct SsaInstruction {
+  SsaOp op;
+  int32_t dst;
+  int32_t lhs;
+  int32_t rhs;
+};
+
+struct SsaSegment {
+  int32_t need;
+  int32_t drop;                 // elements removed before pushing outputs
+  std::vector<SsaInstruction> code;
+  std::vector<int32_t> outputs; // registers pushed bottom to top
+  std::vector<std::shared_ptr<Command>> fallback;
+  std::shared_ptr<Command> barrier; // runs on the real stack afterwards
+};
+
+enum class SsaExit {
+  Jump,
+  Halt,
+  Jez,
+  Switch,
+  Pointer,
+  DupBranchZero
+};
+
+struct SsaBlock {
+  std::vector<SsaSegment> segments;
+  SsaExit exit;
+  int32_t cond;                 // register holding the branch operand
+  Successors next_index;
+};
+
+class SsaGraph {
+ public:
+  explicit SsaGraph(const BasicBlockGraph &bbg);
+  void exec() const;
+  size_t size() const { return blocks.size(); }
+  friend std::ostream& operator<<(std::ostream &os, const SsaGraph &ssa);
+ private:
+  std::vector<SsaBlock> blocks;
+  int32_t register_count;
+};
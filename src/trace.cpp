@@ -0,0 +1,80 @@
+#include "trace.hpp"
+
+namespace {
+
+// edge executions before its target starts a trace
+constexpr uint32_t hot_threshold = 64;
+// recordings longer than this are given up
+constexpr size_t max_trace_blocks = 256;
+constexpr int32_t max_attempts = 3;
+
+Opcode guard_for(const Opcode branch) {
+  switch (branch) {
+    case Opcode::Jez: return Opcode::GuardJez;
+    case Opcode::Switch: return Opcode::GuardSwitch;
+    case Opcode::Pointer: return Opcode::GuardPointer;
+    case Opcode::DupBranchZero: return Opcode::GuardDupBranchZero;
+    default: return Opcode::Exit;
+  }
+}
+
+} // namespace
+
+Tracer::Tracer(const BasicBlockGraph &bbg)
+  : bbg(bbg), code(), pool(), entry(bbg.size()), trace(bbg.size(), -1),
+    edge_count(bbg.size()), attempts(bbg.size(), 0), traces(0), side_exits(0) {
+  // tier 0: each block ends in a guard that never matches, so control
+  // comes back here after every block
+  for (size_t i = 0; i < bbg.size(); ++i) {
+    entry[i] = code.size();
+    const Opcode branch = lower_body(bbg[i], code, pool);
+    if (branch == Opcode::Halt || bbg[i].get_next_index().empty()) {
+      code.push_back(Instruction { Opcode::Halt, 0, 0 });
+    } else {
+      code.push_back(Instruction { guard_for(branch), -1, static_cast<int32_t>(i) });
+    }
+    edge_count[i].resize(bbg[i].get_next_index().size());
+  }
+}
+
+void Tracer::compile(const std::vector<Edge> &path) {
+  const int32_t start = code.size();
+  for (const auto &edge : path) {
+    const Opcode branch = lower_body(bbg[edge.block], code, pool);
+    if (branch != Opcode::Jump) {
+      code.push_back(Instruction { guard_for(branch), edge.slot, edge.block });
+    }
+  }
+  code.push_back(Instruction { Opcode::Jump, start, 0 });
+  trace[path.front().block] = start;
+  ++traces;
+}
+
+void Tracer::exec() {
+  Stack stack;
+  std::vector<Edge> path;
+  int32_t header = -1;  // block being recorded from, -1 when not recording
+  int32_t block = 0;
+  while (true) {
+    const bool traced = header < 0 && trace[block] >= 0;
+    const auto exit = run(code.data(), pool.data(), code.data() + (traced ? trace[block] : entry[block]), stack);
+    if (exit.block < 0) return;
+    if (traced) ++side_exits;
+    const int32_t next = bbg[exit.block].get_next_index()[exit.slot];
+    if (header >= 0) {
+      path.push_back(Edge { exit.block, exit.slot });
+      if (next == header) {
+        compile(path);
+        header = -1;
+      } else if (path.size() >= max_trace_blocks) {
+        header = -1;
+      }
+    } else if (++edge_count[exit.block][exit.slot] == hot_threshold
+        && trace[next] < 0 && attempts[next] < max_attempts) {
+      ++attempts[next];
+      header = next;
+      path.clear();
+    }
+    block = next;
+  }
+}
@@ -0,0 +1,36 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include "basic_blocks.hpp"
+#include "bytecode.hpp"
+
+// Tiered execution on top of the bytecode interpreter.
+//
+// Blocks first run one at a time and every edge of their next_index table is
+// counted. When an edge gets hot, the blocks executed from its target are
+// recorded until control comes back there, and that path is compiled into a
+// single bytecode trace: block bodies are concatenated, branches become
+// guards on the recorded successor, and the end jumps back to the start.
+// A failing guard leaves the trace at the successor that was actually taken.
+class Tracer {
+ public:
+  explicit Tracer(const BasicBlockGraph &bbg);
+  void exec();
+  size_t trace_count() const { return traces; }
+  size_t side_exit_count() const { return side_exits; }
+ private:
+  struct Edge {
+    int32_t block;
+    int32_t slot;
+  };
+  void compile(const std::vector<Edge> &path);
+  const BasicBlockGraph &bbg;
+  std::vector<Instruction> code;
+  std::vector<int32_t> pool;
+  std::vector<int32_t> entry;                   // offset of each block's own code
+  std::vector<int32_t> trace;                   // offset of the trace starting at a block, or -1
+  std::vector<std::vector<uint32_t>> edge_count; // shaped like next_index
+  std::vector<int32_t> attempts;                // recordings started at a block
+  size_t traces;
+  size_t side_exits;
+};
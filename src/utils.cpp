@@ -39,3 +39,17 @@ bool operator!=(const Color &lhs, const Color &rhs) {
 Color unknown_color() {
   return Color { Hue::UNKNOWN, Brightness::UNKNOWN };
 }
+
+Codel to_codel(const Color &color) {
+  if (is_white(color)) return white_codel;
+  if (is_black(color)) return black_codel;
+  if (!is_color(color)) return unknown_codel;
+  return (static_cast<int>(color.hue) - 1) * 3 + static_cast<int>(color.brightness) - 1;
+}
+
+Color to_color(const Codel codel) {
+  if (is_white(codel)) return Color { Hue::WHITE, Brightness::WHITE };
+  if (is_black(codel)) return Color { Hue::BLACK, Brightness::BLACK };
+  if (!is_color(codel)) return unknown_color();
+  return Color { static_cast<Hue>(codel / 3 + 1), static_cast<Brightness>(codel % 3 + 1) };
+}
@@ -1,4 +1,6 @@
 #pragma once
+#include <algorithm>
+#include <cstdint>
 #include <vector>
 #include <png++/png.hpp>
 
@@ -28,18 +30,109 @@ bool operator==(const Color &, const Color &);
 bool operator!=(const Color &, const Color &);
 Color unknown_color();
 
-class CodelsTable {
+// One byte per codel: hue * 3 + lightness for the 18 colors (hue from red
+// to magenta, lightness from light to dark), then white, black and unknown
+using Codel = uint8_t;
+constexpr Codel white_codel = 18;
+constexpr Codel black_codel = 19;
+constexpr Codel unknown_codel = 20;
+// codels that can be on either side of a command
+constexpr std::size_t codel_kinds = 20;
+
+inline bool is_black(const Codel codel) { return codel == black_codel; }
+inline bool is_white(const Codel codel) { return codel == white_codel; }
+inline bool is_color(const Codel codel) { return codel < white_codel; }
+Codel to_codel(const Color &);
+Color to_color(const Codel);
+
+// Order of the cells of a Grid. rows is plain row-major with rows padded to
+// whole cache lines; tiles stores 8x8 tiles one after another, each tile
+// row-major, so vertical neighbours are usually in the same or the next
+// cache line.
+enum class GridLayout { rows, tiles };
+
+// Position of each cell of a width x height grid in a flat buffer
+class GridShape {
  public:
-  CodelsTable(const std::size_t height, const std::size_t width)
-    : data(height, std::vector<Color>(width)) {}
-  Color set(const std::size_t i, const std::size_t j, const Color& color) {
-    return data.at(i).at(j) = color;
+  static constexpr std::size_t tile = 8;
+  GridShape(const std::size_t width, const std::size_t height, const std::size_t line, const GridLayout layout)
+    : width_(width), height_(height), layout_(layout),
+      stride_(layout == GridLayout::tiles ? round_up(width, tile) * tile : round_up(width, line)) {}
+  std::size_t size() const {
+    return layout_ == GridLayout::tiles ? stride_ * (round_up(height_, tile) / tile) : stride_ * height_;
   }
-  Color get(const std::size_t i, const std::size_t j) const {
-    return data.at(i).at(j);
+  // offset of (0, y), and of (x, y) relative to it
+  std::size_t row(const std::size_t y) const {
+    return layout_ == GridLayout::tiles ? y / tile * stride_ + y % tile * tile : y * stride_;
   }
-  std::size_t height() const { return data.size(); }
-  std::size_t width() const { return data.front().size(); }
+  static std::size_t column(const GridLayout layout, const std::size_t x) {
+    return layout == GridLayout::tiles ? x / tile * tile * tile + x % tile : x;
+  }
+  std::size_t offset(const std::size_t x, const std::size_t y) const { return row(y) + column(layout_, x); }
+  std::size_t width() const { return width_; }
+  std::size_t height() const { return height_; }
+  GridLayout layout() const { return layout_; }
  private:
-  std::vector<std::vector<Color>> data;
+  static std::size_t round_up(const std::size_t n, const std::size_t m) { return (n + m - 1) / m * m; }
+  std::size_t width_;
+  std::size_t height_;
+  GridLayout layout_;
+  std::size_t stride_;  // distance between rows, or between rows of tiles
 };
+
+// 2D array in one allocation, laid out as chosen at construction.
+// grid[y][x] works in either layout; row_data is for row-major grids only.
+template <typename T>
+class Grid {
+ public:
+  template <typename U>
+  class Row {
+   public:
+    Row(U *base, const GridLayout layout) : base(base), layout(layout) {}
+    U &operator[](const std::size_t x) const { return base[GridShape::column(layout, x)]; }
+   private:
+    U *base;
+    GridLayout layout;
+  };
+  Grid() : shape(0, 0, line, GridLayout::rows), data() {}
+  Grid(const std::size_t width, const std::size_t height, const T &value = T(), const GridLayout layout = GridLayout::rows)
+    : shape(width, height, line, layout), data(shape.size(), value) {}
+  Row<T> operator[](const std::size_t y) { return Row<T>(data.data() + shape.row(y), shape.layout()); }
+  Row<const T> operator[](const std::size_t y) const { return Row<const T>(data.data() + shape.row(y), shape.layout()); }
+  T *row_data(const std::size_t y) { return data.data() + shape.row(y); }
+  const T *row_data(const std::size_t y) const { return data.data() + shape.row(y); }
+  std::size_t width() const { return shape.width(); }
+  std::size_t height() const { return shape.height(); }
+  GridLayout layout() const { return shape.layout(); }
+  // sets [x0, x1) of row y
+  void fill_row(const std::size_t y, std::size_t x0, const std::size_t x1, const T &value) {
+    T *base = row_data(y);
+    if (layout() == GridLayout::rows) {
+      std::fill(base + x0, base + x1, value);
+      return;
+    }
+    while (x0 < x1) {
+      const std::size_t end = std::min(x1, (x0 / GridShape::tile + 1) * GridShape::tile);
+      const std::size_t at = GridShape::column(GridLayout::tiles, x0);
+      std::fill(base + at, base + at + (end - x0), value);
+      x0 = end;
+    }
+  }
+  // copy of the grid in another layout
+  Grid relayout(const GridLayout layout) const {
+    Grid res(width(), height(), T(), layout);
+#pragma omp parallel for
+    for (std::size_t y = 0; y < height(); ++y) {
+      const auto from = (*this)[y];
+      const auto to = res[y];
+      for (std::size_t x = 0; x < width(); ++x) to[x] = from[x];
+    }
+    return res;
+  }
+ private:
+  static constexpr std::size_t line = std::max<std::size_t>(1, 64 / sizeof(T));
+  GridShape shape;
+  std::vector<T> data;
+};
+
+using CodelsTable = Grid<Codel>;
@@ -38,61 +38,3 @@ void show_pixel(const Pixel& pixel) {
   }
 }
 */
-
-size_t gcd(size_t a, size_t b) {
-  if (b == 0) {
-    return a;
-  } else {
-    return gcd(b, a % b);
-  }
-}
-
-bool same_pixel(const Pixel& lhs, const Pixel& rhs) {
-  return lhs.red == rhs.red && lhs.green == rhs.green && lhs.blue == rhs.blue;
-}
-
-size_t codel_size(const Image& image) {
-  const size_t width = image.get_width();
-  const size_t height = image.get_height();
-  Pixel prev;
-  size_t minimum = gcd(width, height);
-  size_t count = 0;
-  // vertical iterate
-  for (size_t row = 0; row < height; ++row) {
-    for (size_t col = 0; col < width; ++col) {
-      const auto pixel = image[row][col];
-      if (0 < count && !same_pixel(prev, pixel)) {
-        minimum = gcd(minimum, count);
-        count = 0;
-      }
-      ++count;
-      prev = pixel;
-    }
-  }
-  count = 0;
-  // horizontal iterate
-  for (size_t col = 0; col < width; ++col) {
-    for (size_t row = 0; row < height; ++row) {
-      const auto pixel = image[row][col];
-      if (0 < count && !same_pixel(prev, pixel)) {
-        minimum = gcd(minimum, count);
-        count = 0;
-      }
-      ++count;
-      prev = pixel;
-    }
-  }
-  return minimum;
-}
-
-/*
-void visualize(const Image& image) {
-  const auto step = codel_size(image);
-  for (size_t row = 0; row < image.get_height(); row += step) {
-    for (size_t col = 0; col < image.get_width(); col += step) {
-      show_pixel(image[row][col]);
-    }
-    std::cout << std::endl;
-  }
-}
-*/